@@ -0,0 +1,419 @@
+/*
+ * Benchmark of the daemon: the sensors are created, sampled, filtered and
+ * published by the code of the daemon itself, reading replay traces, and
+ * publish to a private dbus-daemon started for the run. Every tick rate
+ * of the sweep runs in a process of its own, so the sensors are created
+ * with that sample and publish period like from a configuration file.
+ * The signals the services send are counted on the bus by dbus-monitor,
+ * not by the daemon.
+ * It needs dbus-daemon and dbus-monitor, but not the hardware.
+ *
+ *     dbus-adc-bench
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_dbus_item.h>
+#include <velib/types/ve_values.h>
+
+#include "sensors.h"
+
+#define BENCH_VREF			1.8 /* V */
+#define BENCH_SCALE			4095
+#define BENCH_ROWS			1000 /* of the trace, a slow swing of 10 C */
+#define BENCH_CUTOFF		1.0f /* Hz, so the swing gets through the low pass */
+#define BENCH_WARMUP		2000 /* ms, the items are created and sent */
+#define BENCH_RUN			5000 /* ms measured */
+
+static const int sensorCounts[] = { 8, 32, 128 };
+static const int tickRates[] = { 1, 10, 100 }; /* Hz */
+
+#ifndef M_PI
+#define M_PI				3.14159265358979323846
+#endif
+
+#define BENCH_MAX_SENSORS	128
+#define BENCH_DEVICES		(BENCH_MAX_SENSORS / ADC_MAX_CHANNELS)
+
+// what a run reports to the parent, through a pipe
+typedef struct {
+	char what; /* 'b' at the start of the measurement, 'e' at its end */
+	double cpu; /* s, user and system time of the run */
+	un32 ticks;
+} BenchMark;
+
+static char busAddress[256];
+static char traces[BENCH_DEVICES][64];
+static struct VeItem *localSettings;
+
+/* one run, in the child */
+static struct {
+	AnalogSensor *sensors[BENCH_MAX_SENSORS];
+	int count;
+	int markFd;
+	struct event *timer;
+	uint64_t start;
+	double cpu;
+	un32 ticks;
+	veBool configured;
+	veBool measuring;
+} run;
+
+/* there is no localsettings on the private bus, the settings stay local */
+struct VeItem *getLocalSettings(void)
+{
+	return localSettings;
+}
+
+static uint64_t timeMs(void)
+{
+	return adcTimeNs() / 1000000;
+}
+
+static double cpuSeconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void mark(char what)
+{
+	BenchMark m = { what, cpuSeconds() - run.cpu, run.ticks };
+
+	if (write(run.markFd, &m, sizeof(m)) != sizeof(m))
+		pltExit(1);
+}
+
+/* lm335 probes around 25 C, each a little out of phase with the others */
+static void writeTraces(void)
+{
+	int d, r, i;
+
+	for (d = 0; d < BENCH_DEVICES; d++) {
+		FILE *f;
+
+		snprintf(traces[d], sizeof(traces[d]), "/tmp/dbus-adc-bench.%d.%d", (int) getpid(), d);
+		f = fopen(traces[d], "w");
+		if (!f) {
+			perror(traces[d]);
+			pltExit(1);
+		}
+
+		for (r = 0; r < BENCH_ROWS; r++) {
+			for (i = 0; i < ADC_MAX_CHANNELS; i++) {
+				double tempC = 25 + 5 * sin(2 * M_PI * (r + 31 * i) / BENCH_ROWS);
+				double v = (tempC + 273) / 100 * 4700 / (10000 + 4700);
+
+				fprintf(f, "%s%d", i ? " " : "", (int) lrint(v / BENCH_VREF * BENCH_SCALE) + rand() % 5 - 2);
+			}
+			fprintf(f, "\n");
+		}
+		fclose(f);
+	}
+}
+
+static void setFloat(struct VeItem *item, float value)
+{
+	VeVariant v;
+
+	veItemOwnerSet(item, veVariantFloat(&v, value));
+}
+
+/* the items of an input are created when it is first published */
+static void configureSensors(void)
+{
+	int i;
+
+	for (i = 0; i < run.count; i++) {
+		struct TemperatureSensor *temperature = (struct TemperatureSensor *) run.sensors[i];
+
+		if (!run.sensors[i]->itemsCreated)
+			return;
+		setFloat(temperature->scaleItem, 1);
+		setFloat(temperature->offsetItem, 0);
+		setFloat(run.sensors[i]->filterItem, BENCH_CUTOFF);
+	}
+
+	run.configured = veTrue;
+}
+
+static void onTimer(evutil_socket_t fd, short events, void *ctx)
+{
+	uint64_t now = timeMs();
+	uint64_t next = sensorTick(now);
+	struct timeval tv;
+
+	run.ticks++;
+
+	if (!run.configured)
+		configureSensors();
+
+	if (!run.measuring && now - run.start >= BENCH_WARMUP) {
+		run.measuring = veTrue;
+		run.ticks = 0;
+		run.cpu = cpuSeconds();
+		mark('b');
+	} else if (run.measuring && now - run.start >= BENCH_WARMUP + BENCH_RUN) {
+		mark('e');
+		pltExit(0);
+	}
+
+	next = next > now ? next - now : 0;
+	tv.tv_sec = next / 1000;
+	tv.tv_usec = next % 1000 * 1000;
+	evtimer_add(run.timer, &tv);
+}
+
+/*
+ * Set up the sensors of a run in the child and return, to be run by the
+ * main loop of velib like the daemon is.
+ */
+static void startRun(int sensors, int rate, int markFd)
+{
+	SensorConfig cfg = { 0 };
+	struct timeval now = { 0, 0 };
+	AdcDevice *dev = NULL;
+	VeVariant v;
+	int i;
+
+	event_reinit(pltGetLibEventBase());
+	veDbusSetDefaultConnectString(busAddress);
+	localSettings = veItemGetOrCreateUid(veValueTree(), "com.victronenergy.settings");
+
+	cfg.scale = BENCH_VREF / BENCH_SCALE;
+	cfg.samplePeriod = 1000 / rate;
+	cfg.publishPeriod = 1000 / rate;
+
+	for (i = 0; i < sensors; i++) {
+		if (i % ADC_MAX_CHANNELS == 0)
+			dev = adcReplayCreate(traces[i / ADC_MAX_CHANNELS]);
+		if (!dev || !(run.sensors[i] = sensorCreate(dev, i % ADC_MAX_CHANNELS, SENSOR_TYPE_TEMP, &cfg)))
+			pltExit(1);
+		veItemOwnerSet(run.sensors[i]->function, veVariantSn32(&v, SENSOR_FUNCTION_DEFAULT));
+	}
+
+	run.count = sensors;
+	run.markFd = markFd;
+	run.start = timeMs();
+
+	adcDevicesStart(veTrue);
+	sensorStart(run.start);
+
+	run.timer = evtimer_new(pltGetLibEventBase(), onTimer, NULL);
+	if (!run.timer)
+		pltExit(1);
+	evtimer_add(run.timer, &now);
+}
+
+static pid_t startBus(void)
+{
+	char pid[32];
+	FILE *f;
+
+	f = popen("dbus-daemon --session --fork --print-address=1 --print-pid=1", "r");
+	if (!f || !fgets(busAddress, sizeof(busAddress), f) || !fgets(pid, sizeof(pid), f)) {
+		fprintf(stderr, "cannot start dbus-daemon\n");
+		pltExit(1);
+	}
+	pclose(f);
+	busAddress[strcspn(busAddress, "\n")] = 0;
+
+	return atoi(pid);
+}
+
+/* signals sent on the bus, one line each in dbus-monitor's profile output */
+static FILE *startMonitor(void)
+{
+	char cmd[320];
+	FILE *f;
+
+	snprintf(cmd, sizeof(cmd), "dbus-monitor --address '%s' --profile type=signal", busAddress);
+	f = popen(cmd, "r");
+	if (!f) {
+		fprintf(stderr, "cannot start dbus-monitor\n");
+		pltExit(1);
+	}
+
+	return f;
+}
+
+// a line of dbus-monitor output, read in pieces
+typedef struct {
+	char buf[512];
+	size_t len;
+} MonitorLine;
+
+/* a signal sent by a client, not by the bus itself */
+static veBool isClientSignal(char *line)
+{
+	char *sender;
+	int i;
+
+	if (strncmp(line, "sig\t", 4))
+		return veFalse;
+
+	/* type, timestamp and serial come before the sender */
+	sender = line;
+	for (i = 0; i < 3 && sender; i++) {
+		sender = strchr(sender, '\t');
+		if (sender)
+			sender++;
+	}
+
+	return sender && strncmp(sender, "org.freedesktop.DBus\t", 21);
+}
+
+/* counts the client signals in the output read from fd */
+static un32 countSignals(int fd, MonitorLine *line)
+{
+	char buf[4096];
+	un32 n = 0;
+	ssize_t len;
+	ssize_t i;
+
+	len = read(fd, buf, sizeof(buf));
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n') {
+			if (line->len < sizeof(line->buf) - 1)
+				line->buf[line->len++] = buf[i];
+			continue;
+		}
+
+		line->buf[line->len] = 0;
+		if (isClientSignal(line->buf))
+			n++;
+		line->len = 0;
+	}
+
+	return n;
+}
+
+/*
+ * Runs a child for the sensors and rate and counts the signals on the
+ * bus between its start and end marks. Returns veFalse in the child,
+ * which goes on to the main loop.
+ */
+static veBool measure(int sensors, int rate, int monitorFd)
+{
+	struct pollfd fds[2];
+	BenchMark b = { 0 }, e = { 0 };
+	MonitorLine line = { .len = 0 };
+	un32 signals = 0;
+	int p[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(p) < 0 || (pid = fork()) < 0) {
+		perror("fork");
+		pltExit(1);
+	}
+
+	if (pid == 0) {
+		close(p[0]);
+		close(monitorFd);
+		startRun(sensors, rate, p[1]);
+		return veFalse;
+	}
+
+	close(p[1]);
+	fds[0].fd = monitorFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = p[0];
+	fds[1].events = POLLIN;
+
+	while (!e.what) {
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			un32 n = countSignals(monitorFd, &line);
+
+			if (b.what)
+				signals += n;
+		}
+
+		if (fds[1].revents & (POLLIN | POLLHUP)) {
+			BenchMark m;
+
+			if (read(p[0], &m, sizeof(m)) != sizeof(m))
+				break;
+			if (m.what == 'b')
+				b = m;
+			else
+				e = m;
+		}
+	}
+
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+
+	if (!e.what) {
+		printf("%8d %8d   run failed\n", sensors, rate);
+		return veTrue;
+	}
+
+	printf("%8d %8d %10.1f %10.1f %12.0f\n", sensors, rate,
+		   e.ticks * 1000.0 / BENCH_RUN, 100.0 * e.cpu * 1000 / BENCH_RUN,
+		   signals * 1000.0 / BENCH_RUN);
+
+	return veTrue;
+}
+
+void taskInit(void)
+{
+	FILE *monitor;
+	pid_t bus;
+	unsigned i, j;
+	int d;
+
+	signal(SIGPIPE, SIG_IGN);
+	writeTraces();
+	bus = startBus();
+	monitor = startMonitor();
+
+	printf("private bus %s\n", busAddress);
+	printf("sample and publish period 1 / rate, %d s per run\n\n", BENCH_RUN / 1000);
+	printf("%8s %8s %10s %10s %12s\n", "sensors", "rate Hz", "ticks/s", "cpu %", "signals/s");
+
+	for (i = 0; i < sizeof(sensorCounts) / sizeof(sensorCounts[0]); i++)
+		for (j = 0; j < sizeof(tickRates) / sizeof(tickRates[0]); j++)
+			if (!measure(sensorCounts[i], tickRates[j], fileno(monitor)))
+				return;
+
+	kill(bus, SIGTERM);
+	pclose(monitor);
+	for (d = 0; d < BENCH_DEVICES; d++)
+		unlink(traces[d]);
+
+	pltExit(0);
+}
+
+void taskUpdate(void)
+{
+}
+
+void taskTick(void)
+{
+}
+
+char const *pltProgramVersion(void)
+{
+	return "bench";
+}
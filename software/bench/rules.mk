@@ -0,0 +1,10 @@
+SRCS += bench.c
+# the daemon, except task.c
+SRCS += ../src/adc.c
+SRCS += ../src/sensors.c
+SRCS += ../src/filter.c
+SRCS += ../src/tankshape.c
+SRCS += ../src/strapping.c
+SRCS += ../src/tempmodel.c
+SRCS += ../src/replay.c
+SRCS += ../src/acquire.c
@@ -1,6 +1,8 @@
 #ifndef SENSORS_H
 #define SENSORS_H
 
+#include <pthread.h>
+
 #include <velib/base/base.h>
 #include <velib/types/ve_item.h>
 
@@ -35,6 +37,30 @@ typedef struct {
 	veBool connected;
 } SensorDbusInterface;
 
+typedef enum {
+	PUBLISH_STATUS,
+	PUBLISH_LEVEL,
+	PUBLISH_REMAINING,
+	PUBLISH_RESISTANCE,
+	PUBLISH_TEMPERATURE,
+	PUBLISH_VOLTAGE,
+	PUBLISH_COUNT
+} PublishKind;
+
+// when a changed value is worth sending
+typedef struct {
+	float abs;
+	float rel; /* fraction of the last value sent */
+	un32 heartbeat; /* ms, resend an unchanged value, 0 never */
+} Deadband;
+
+// the last value sent for an item
+typedef struct {
+	float value;
+	veBool valid;
+	uint64_t sent;
+} PublishState;
+
 // sensor signal correction parameters
 typedef struct {
 	float scale;
@@ -44,33 +70,214 @@ typedef struct {
 // Single pole iir low pass filter variables
 typedef struct {
 	float FF;
-	float fc;
+	float alpha; /* see adcFilterAlpha() */
 	float last;
 } FilerIirLpf;
 
+#define FILTER_MAX_OVERSAMPLE	64
+#define FILTER_MAX_MEDIAN		9
+#define FILTER_MAX_AVERAGE		32
+#define FILTER_MAX_POLES		4
+
+// signal conditioning stages around the single pole IIR low pass
+typedef struct {
+	un8 oversample; /* samples per decimated sample */
+	un8 median; /* odd window length of the spike rejector */
+	un8 average; /* moving average length */
+	un8 poles; /* IIR low pass poles */
+} FilterConfig;
+
+// state of the stages, in fixed size buffers
+typedef struct {
+	FilterConfig cfg;
+	/* oversampling, boxcar decimation */
+	float decimSum;
+	un8 decimCount;
+	/* median of K spike rejection */
+	float medianBuf[FILTER_MAX_MEDIAN];
+	un8 medianPos;
+	un8 medianLen;
+	/* moving average */
+	float averageBuf[FILTER_MAX_AVERAGE];
+	double averageSum;
+	un8 averagePos;
+	un8 averageLen;
+	/* the poles after the first */
+	float pole[FILTER_MAX_POLES - 1];
+} FilterChain;
+
 // building a sensor signal conditioning structure
 typedef struct {
 	SignalCorrection sigCorrect;
-	FilerIirLpf filterIirLpf;
 } SignalCondition;
 
+#define ADC_LATENCY_BUCKETS	8
+
+/*
+ * Counters updated on a worker or the acquisition thread and read by the
+ * main loop. Each has one writer, so a plain increment stored atomically
+ * will do; the reader never sees a torn word.
+ */
+#define STAT_INC(c)		__atomic_store_n(&(c), (c) + 1, __ATOMIC_RELAXED)
+#define STAT_GET(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+// per channel access counters
+typedef struct {
+	un32 reads; /* samples taken, by any backend */
+	un32 syscalls;
+	un32 errors;
+	un32 reopens;
+	un32 latency[ADC_LATENCY_BUCKETS]; /* reads taking less than 4^(i+1) us, the last all others */
+} AdcChannelStats;
+
+#define ADC_MAX_CHANNELS	32
+
+struct AdcDevice;
+
+// an adc input, read from sysfs or from the buffer of its device
+typedef struct {
+	struct AdcDevice *dev;
+	int pin;
+	int fd;
+	AdcChannelStats stats;
+	/* position in a buffered scan frame */
+	un8 offset;
+	un8 bytes;
+	un8 bits;
+	un8 shift;
+	veBool isSigned;
+	veBool bigEndian;
+	/* samples collected from the buffer */
+	int64_t sum;
+	un32 count;
+	/* the last read cycle */
+	veBool due;
+	veBool ok;
+	un32 value;
+	uint64_t time; /* CLOCK_MONOTONIC ns of the read */
+} AdcChannel;
+
+// the way the channels of a device are read
+typedef struct {
+	const char *name;
+	veBool mayBlock; /* read on a worker thread when there are more devices */
+	veBool (*open)(struct AdcDevice *dev);
+	/* read the due channels, setting their ok and value */
+	void (*readBatch)(struct AdcDevice *dev);
+	void (*close)(struct AdcDevice *dev);
+} AdcBackend;
+
+extern const AdcBackend adcSysfsBackend;
+extern const AdcBackend adcBufferBackend;
+extern const AdcBackend adcReplayBackend;
+
+// an iio device, read per channel from sysfs or through its buffer
+typedef struct AdcDevice {
+	struct AdcDevice *next;
+	char name[64];
+	const AdcBackend *backend;
+	int dirfd;
+	unsigned bufLength;
+	unsigned watermark;
+	char trigger[32];
+	unsigned rate; /* Hz, of a hrtimer trigger, 0 for a watermark per sample period */
+	un32 samplePeriod; /* ms, the shortest of the sensors on the device */
+	veBool buffered;
+	veBool wakeOnData;
+	int bufFd;
+	int triggerFd;
+	unsigned frameSize;
+	int timestampOffset; /* -1 without CLOCK_MONOTONIC scan timestamps */
+	un32 scans; /* read in the last batch */
+	int64_t firstTimestamp; /* ns, of the scans in the last batch */
+	int64_t timestamp;
+	/* recorded samples, a row per read and a column per pin */
+	char *traceFile;
+	un32 *trace;
+	unsigned traceRows;
+	unsigned traceColumns;
+	unsigned tracePos;
+	/* read cycles on a worker thread */
+	veBool threaded;
+	veBool requested;
+	veBool run; /* a cycle for the worker to start */
+	veBool busy; /* from the request until adcDeviceRelease() */
+	int doneFd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int channelCount;
+	AdcChannel channels[ADC_MAX_CHANNELS];
+} AdcDevice;
+
+// a sample taken by the acquisition thread
+typedef struct {
+	int index; /* in the SensorTable */
+	veBool ok;
+	un32 value;
+	uint64_t time; /* CLOCK_MONOTONIC ns of the read */
+} AcquiredSample;
+
+// lock-free single producer, single consumer queue of samples
+typedef struct {
+	AcquiredSample *buf;
+	un32 mask; /* size - 1, the size is a power of two */
+	/* free running, on cache lines of their own */
+	un32 head __attribute__((aligned(64))); /* only stored by the producer */
+	un32 tail __attribute__((aligned(64))); /* only stored by the consumer */
+} SampleRing;
+
 // building a sensor interface structure
 typedef struct {
-	int devfd;
-	int adcPin;
-	float adcScale;
-	float adcSample;
-	float adcSampleRaw;
 	SignalCondition sigCond;
 	SensorDbusInterface dbus;
 } SensorInterface;
 
+// per sensor settings from the configuration file
+typedef struct {
+	float scale;
+	un32 samplePeriod; /* ms, 0 for the type default */
+	un32 publishPeriod; /* ms, 0 for the type default */
+	FilterConfig filter;
+} SensorConfig;
+
+// a /Debug counter and the value last sent for it
+typedef struct {
+	struct VeItem *item;
+	un32 value;
+	veBool valid;
+} DebugItem;
+
+// diagnostics of a sensor, published under /Debug
+typedef struct {
+	un32 overruns; /* sample deadlines missed by a whole period or more */
+	un32 lost; /* samples dropped, the previous read cycle hadn't finished or the ring was full */
+	un32 messages; /* item changes sent */
+	uint64_t nextPublish;
+	DebugItem reads;
+	DebugItem readErrors;
+	DebugItem reopens;
+	DebugItem syscalls;
+	DebugItem readLatency[ADC_LATENCY_BUCKETS];
+	DebugItem filterResets;
+	DebugItem overrunsItem;
+	DebugItem lostItem;
+	DebugItem messagesItem;
+	DebugItem tickTime;
+	DebugItem tickTimeMax;
+} SensorPerf;
+
 // building a sensor structure
 typedef struct {
 	SensorType sensorType;
+	int index; /* in the SensorTable */
 	int number; /* per type */
 	int instance;
-	veBool valid;
+	un32 publishPeriod;
+	uint64_t nextPublish;
+	float filterCutoff; /* Hz */
+	veBool functionArrived; /* the Function setting came from localsettings */
+	veBool itemsCreated;
 	SensorInterface interface;
 	struct VeDbus *dbus;
 	struct VeItem *root;
@@ -81,14 +288,31 @@ typedef struct {
 	char ifaceName[32];
 	struct VeItem *statusItem;
 	struct VeItem *rawValueItem;
+	struct VeItem *filterItem;
+	PublishState statusPub;
+	PublishState rawValuePub;
+	SensorPerf perf;
 } AnalogSensor;
 
-#define TANK_SHAPE_MAX_POINTS 10
+// the tank settings, converted to the sensor voltage
+typedef struct {
+	veBool valid; /* cleared when a setting changes */
+	float vOpen; /* above this the sender is not connected */
+	float vShort; /* below this it is shorted, 0 if not detected */
+	float gain; /* level = v * gain / (vref - v) - offset */
+	float offset;
+	float capacity;
+} TankConversion;
+
+#define TANK_SHAPE_MAX_POINTS	100
+#define TANK_SHAPE_LUT_SIZE		200 /* a multiple of 100, see tankShapeSetNodes() */
 
 struct TankSensor {
 	AnalogSensor sensor;
-	int shapeMapLen;
-	float shapeMap[TANK_SHAPE_MAX_POINTS + 2][2];
+	veBool hasShape;
+	veBool strapped; /* shape from a strapping table, the Shape setting is ignored */
+	/* per 1 / TANK_SHAPE_LUT_SIZE of sensor level: tank level at its start, rise over it */
+	float shapeLut[TANK_SHAPE_LUT_SIZE][2];
 	struct VeItem *levelItem;
 	struct VeItem *remaingItem;
 	struct VeItem *capacityItem;
@@ -97,22 +321,178 @@ struct TankSensor {
 	struct VeItem *emptyRItem;
 	struct VeItem *fullRItem;
 	struct VeItem *shapeItem;
+	TankConversion conv;
+	PublishState levelPub;
+	PublishState remainingPub;
 };
 
+#define TEMP_MODEL_LUT_SIZE	512
+
+// the bias of a resistive temperature probe
+typedef struct {
+	float supply; /* V */
+	float pullUp; /* ohm */
+	float load; /* ohm, parallel to the probe */
+} TempFrontEnd;
+
+// a resistive temperature probe, converted through a lookup table
+typedef struct TempModel {
+	const char *name;
+	double (*resistance)(double tempC);
+	float minC;
+	float maxC;
+	/* built per front end, see tempModelGet() */
+	TempFrontEnd fe;
+	struct TempModel *next;
+	float vLo;
+	float vHi;
+	float cellsPerVolt;
+	float lut[TEMP_MODEL_LUT_SIZE][2]; /* temperature at the start of a cell, rise over it */
+} TempModel;
+
 struct TemperatureSensor {
 	AnalogSensor sensor;
+	const TempModel *model; /* NULL for the LM335 */
 	struct VeItem *temperatureItem;
 	struct VeItem *scaleItem;
 	struct VeItem *offsetItem;
+	PublishState temperaturePub;
 };
 
-AnalogSensor *sensorCreate(int devfd, int pin, float scale, SensorType type,
-						   const char *drv);
-void sensorTick(void);
+/*
+ * The state touched on every sample, kept in arrays indexed by
+ * AnalogSensor.index so a tick streams through it linearly. The arrays
+ * grow as sensors are added; don't keep pointers into them.
+ */
+typedef struct {
+	int count;
+	int size;
+	AnalogSensor **sensor;
+	AdcChannel **channel;
+	float *value;
+	sn32 *update;
+	float *scale;
+	float *sampleRaw;
+	float *sample;
+	float *filterFF;
+	float *filterAlpha;
+	float *filterLast;
+	un32 *filterDt; /* us, the interval filterAlpha is computed for */
+	uint64_t *filterTime; /* ns, of the last sample filtered */
+	sn32 *filterResets;
+	FilterChain **filterChain; /* NULL for the IIR low pass only */
+	veBool *valid;
+	veBool *pending;
+	un32 *samplePeriod;
+	uint64_t *nextSample;
+#ifdef ADC_FIXED_POINT
+	un32 *valueQ;
+	un32 *scaleQ;
+	sn32 *filterFFQ;
+	sn32 *filterAlphaQ;
+	sn32 *filterLastQ;
+	sn32 *sampleRawQ;
+	sn32 *sampleQ;
+#endif
+} SensorTable;
+
+AnalogSensor *sensorCreate(AdcDevice *dev, int pin, SensorType type,
+						   const SensorConfig *cfg);
+void sensorStart(uint64_t now);
+uint64_t sensorTick(uint64_t now);
+void sensorDeviceData(AdcDevice *dev);
+void sensorDeviceReadable(AdcDevice *dev, uint64_t now);
+void sensorSetRealtime(int priority);
+int sensorAcquireFd(void);
+uint64_t sensorAcquire(uint64_t now);
+void sensorAcquiredData(void);
+veBool sensorSetDeadband(const char *item, float abs, float rel);
+void sensorSetHeartbeat(un32 heartbeat);
 int sensorAdd(int devfd, int pin, float scale, int type);
+veBool sensorSetStrapping(AnalogSensor *sensor, const char *file);
+veBool sensorSetTemperatureModel(AnalogSensor *sensor, const char *name,
+								 float supply, float pullUp);
+
+AdcDevice *adcDeviceCreate(const char *name, int dirfd);
+AdcDevice *adcReplayCreate(const char *file);
+AdcChannel *adcDeviceAddChannel(AdcDevice *dev, int pin);
+AdcDevice *adcDeviceList(void);
+int adcDevicesMayBlock(void);
+void adcDevicesStart(veBool workers);
+veBool adcDeviceBusy(AdcDevice *dev);
+void adcDeviceRequest(AdcDevice *dev);
+void adcDeviceDone(AdcDevice *dev);
+void adcDeviceRelease(AdcDevice *dev);
 
-veBool adcRead(un32 *value, AnalogSensor *sensor);
+uint64_t adcTimeNs(void);
+veBool adcOpen(AdcChannel *chan);
+void adcClose(AdcChannel *chan);
+veBool adcRead(un32 *value, AdcChannel *chan);
 float adcFilter(float x, FilerIirLpf *f);
+float adcFilterAlpha(float fc, float period);
+
+// structure-of-arrays arguments of adcFilterBatch()
+typedef struct {
+	const float *value; /* adc counts */
+	const sn32 *update; /* nonzero for the lanes to update */
+	const float *scale;
+	const float *FF;
+	const float *alpha;
+	float *last;
+	float *sampleRaw;
+	float *sample;
+	sn32 *resets; /* counts the fast follows, the first sample included */
+} AdcFilterBatch;
+
+void adcFilterBatch(const AdcFilterBatch *b, int n);
+void adcFilterBatchRef(const AdcFilterBatch *b, int n);
+
+#ifdef ADC_FIXED_POINT
+/*
+ * Fixed point samples, for targets without a fast FPU. The adc counts
+ * are Q16.16, the volts Q8.24 so a slow filter doesn't get stuck on the
+ * rounding, the filter coefficient Q2.30 and the scale, which is well
+ * below 1 V per count, Q0.32.
+ */
+#define Q16_ONE		(1 << 16)
+#define Q24_ONE		(1 << 24)
+#define Q30_ONE		(1 << 30)
+#define Q_UNSET		INT32_MIN /* no filter output yet */
+
+// structure-of-arrays arguments of adcFilterBatchFixed()
+typedef struct {
+	const un32 *value; /* adc counts, Q16.16 */
+	const sn32 *update; /* nonzero for the lanes to update */
+	const un32 *scale; /* V per count, Q0.32 */
+	const sn32 *FF; /* V, Q8.24 */
+	const sn32 *alpha; /* Q2.30 */
+	sn32 *last; /* V, Q8.24 */
+	sn32 *sampleRaw;
+	sn32 *sample;
+	sn32 *resets;
+} AdcFilterBatchFixed;
+
+void adcFilterBatchFixed(const AdcFilterBatchFixed *b, int n);
+#endif
+
+FilterChain *filterChainCreate(const FilterConfig *cfg);
+veBool filterChainIn(FilterChain *c, float *x);
+float filterChainOut(FilterChain *c, float y, float alpha, float FF);
+
+veBool sampleRingInit(SampleRing *ring, un32 size);
+veBool sampleRingPush(SampleRing *ring, const AcquiredSample *s);
+veBool sampleRingPop(SampleRing *ring, AcquiredSample *s);
+veBool acquireStart(int priority);
+
+void tankShapeSetNodes(struct TankSensor *tank, float const *node);
+int tankShapeParse(const char *map, float (*points)[2]);
+void tankShapeCompile(struct TankSensor *tank, float const (*points)[2], int n);
+float tankShapeLevel(const struct TankSensor *tank, float level);
+
+veBool strappingLoad(const char *file, float *node, int n);
+
+const TempModel *tempModelGet(const char *name, const TempFrontEnd *fe);
+SensorStatus tempModelConvert(const TempModel *m, float v, float *tempC);
 
 struct VeItem *getLocalSettings(void);
 
@@ -1,5 +1,7 @@
 DBUS = 1
 #NMEA2K = 1
+# integer sample processing, for targets without a fast FPU
+#FIXED_POINT = 1
 
 #ifdef DBUS
 T = dbus-adc$(EXT)
@@ -16,14 +18,38 @@ $T_DEPS += $(call subtree_tgts,$(d)/ext/velib)
 SUBDIRS += src
 $T_DEPS += $(call subtree_tgts,$(d)/src)
 
+# benchmark of the sampling pipeline, not installed
+B = dbus-adc-bench$(EXT)
+TARGETS += $B
+$B_DEPS += $(call subtree_tgts,$(d)/ext/velib)
+
+SUBDIRS += bench
+$B_DEPS += $(call subtree_tgts,$(d)/bench)
+
+# checks of the sample filters, exits non-zero on a failure, not installed
+C = dbus-adc-test$(EXT)
+TARGETS += $C
+$C_DEPS += $(call subtree_tgts,$(d)/ext/velib)
+
+SUBDIRS += test
+$C_DEPS += $(call subtree_tgts,$(d)/test)
+
+ifdef FIXED_POINT
+DEFINES += ADC_FIXED_POINT
+endif
+
 #ifdef DBUS
 DEFINES += DBUS
 override CFLAGS += $(shell pkg-config --cflags dbus-1)
 $T_LIBS += -lpthread -ldl `pkg-config --libs dbus-1` -levent -levent_pthreads
+$B_LIBS += -lpthread -ldl `pkg-config --libs dbus-1` -levent -levent_pthreads
+$C_LIBS += -lpthread -ldl `pkg-config --libs dbus-1` -levent -levent_pthreads
 #endif
 
 ifdef POSIX
 $T_LIBS += -lpthread -ldl -lm
+$B_LIBS += -lpthread -ldl -lm
+$C_LIBS += -lpthread -ldl -lm
 endif
 
 ifdef WINDOWS
@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+/**
+ * @brief allocates the samples of a ring
+ * @param ring - the ring, zeroed
+ * @param size - number of samples, rounded up to a power of two
+ * @return veTrue on success
+ */
+veBool sampleRingInit(SampleRing *ring, un32 size)
+{
+	un32 n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	ring->buf = calloc(n, sizeof(*ring->buf));
+	if (!ring->buf)
+		return veFalse;
+
+	ring->mask = n - 1;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return veTrue;
+}
+
+/*
+ * The sample is stored before the head is released, and only reused
+ * after the consumer released the tail past it, so neither side needs
+ * a lock or a system call.
+ */
+
+/**
+ * @brief queues a sample, from the producer thread only
+ * @param ring - the ring
+ * @param s - the sample
+ * @return veFalse when the ring is full, the sample is dropped
+ */
+veBool sampleRingPush(SampleRing *ring, const AcquiredSample *s)
+{
+	un32 head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+		return veFalse;
+
+	ring->buf[head & ring->mask] = *s;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return veTrue;
+}
+
+/**
+ * @brief takes the oldest sample, from the consumer thread only
+ * @param ring - the ring
+ * @param s - receives the sample
+ * @return veFalse when the ring is empty
+ */
+veBool sampleRingPop(SampleRing *ring, AcquiredSample *s)
+{
+	un32 tail = ring->tail;
+
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return veFalse;
+
+	*s = ring->buf[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return veTrue;
+}
+
+/*
+ * Sleep until the earliest sample deadline, on absolute times so the
+ * time spent reading doesn't add up, and sample. The thread ends when
+ * there is nothing left to poll.
+ */
+static void *acquireThread(void *ctx)
+{
+	uint64_t next = adcTimeNs() / 1000000;
+	struct timespec ts;
+
+	while (next != UINT64_MAX) {
+		ts.tv_sec = next / 1000;
+		ts.tv_nsec = next % 1000 * 1000000;
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			continue;
+
+		next = sensorAcquire(adcTimeNs() / 1000000);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief starts the acquisition thread
+ * @param priority - SCHED_FIFO priority, 0 for the normal scheduler
+ * @return veTrue when the thread is running
+ *
+ * Without the privileges for SCHED_FIFO the thread is started at normal
+ * priority, it still doesn't wait for the main loop.
+ */
+veBool acquireStart(int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret = EPERM;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (priority) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+		ret = pthread_create(&thread, &attr, acquireThread, NULL);
+		if (ret == EPERM) {
+			logE("acquire", "no permission for SCHED_FIFO, using the normal scheduler");
+			pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+			priority = 0;
+		}
+	}
+
+	if (ret == EPERM)
+		ret = pthread_create(&thread, &attr, acquireThread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		logE("acquire", "cannot start the acquisition thread: %s", strerror(ret));
+		return veFalse;
+	}
+
+	if (priority)
+		logI("acquire", "acquisition thread at SCHED_FIFO priority %d", priority);
+	else
+		logI("acquire", "acquisition thread at normal priority");
+
+	return veTrue;
+}
@@ -1,46 +1,904 @@
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <velib/utils/ve_logger.h>
 
 #include "sensors.h"
 
+#define IIO_DEVICES_DIR		"/sys/bus/iio/devices"
+#define IIO_HRTIMER_DIR		"/sys/kernel/config/iio/triggers/hrtimer"
+
+static AdcDevice *devices;
+
+static veBool readAttr(int dirfd, const char *attr, char *buf, size_t len)
+{
+	int fd;
+	int n;
+
+	fd = openat(dirfd, attr, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return veFalse;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+
+	if (n <= 0)
+		return veFalse;
+
+	if (buf[n - 1] == '\n')
+		n--;
+	buf[n] = 0;
+
+	return veTrue;
+}
+
+static veBool writeAttr(int dirfd, const char *attr, const char *val)
+{
+	int len = strlen(val);
+	int fd;
+	int n;
+
+	fd = openat(dirfd, attr, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		logE("adc", "%s: %s", attr, strerror(errno));
+		return veFalse;
+	}
+
+	n = write(fd, val, len);
+	if (n != len)
+		logE("adc", "%s: %s", attr, n < 0 ? strerror(errno) : "short write");
+	close(fd);
+
+	return n == len;
+}
+
 /**
- * @brief performs an adc sample read
- * @param value - a pointer to the variable which will store the result
- * @param sensor - pointer to sensor struct
+ * @brief registers an iio device
+ * @param name - name of the device under /sys/bus/iio/devices
+ * @param dirfd - file descriptor of the device sysfs directory
+ * @return Pointer to the device struct
+ *
+ * A device declared more than once is registered only once, so all of
+ * its inputs end up in the same read cycle.
+ */
+AdcDevice *adcDeviceCreate(const char *name, int dirfd)
+{
+	AdcDevice *dev;
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (!strcmp(dev->name, name)) {
+			if (dirfd >= 0)
+				close(dirfd);
+			return dev;
+		}
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	dev->dirfd = dirfd;
+	dev->bufFd = -1;
+	dev->triggerFd = -1;
+	dev->timestampOffset = -1;
+	dev->doneFd = -1;
+
+	dev->next = devices;
+	devices = dev;
+
+	return dev;
+}
+
+/**
+ * @brief adds an adc input to the channels read by the device
+ * @param dev - pointer to the device struct
+ * @param pin - ADC pin number
+ * @return Pointer to the channel struct, NULL if there are too many
+ */
+AdcChannel *adcDeviceAddChannel(AdcDevice *dev, int pin)
+{
+	AdcChannel *chan;
+	int i;
+
+	for (i = 0; i < dev->channelCount; i++)
+		if (dev->channels[i].pin == pin)
+			return &dev->channels[i];
+
+	if (dev->channelCount == ADC_MAX_CHANNELS)
+		return NULL;
+
+	chan = &dev->channels[dev->channelCount++];
+	chan->dev = dev;
+	chan->pin = pin;
+	chan->fd = -1;
+
+	return chan;
+}
+
+/* find the sysfs directory of a trigger by name, creating a hrtimer if needed */
+static int adcTriggerOpen(const char *name)
+{
+	char path[300];
+	char buf[64];
+	struct dirent *de;
+	veBool created = veFalse;
+	int fd = -1;
+	DIR *dir;
+
+	for (;;) {
+		dir = opendir(IIO_DEVICES_DIR);
+		if (!dir)
+			return -1;
+
+		while (fd < 0 && (de = readdir(dir))) {
+			if (strncmp(de->d_name, "trigger", 7))
+				continue;
+
+			snprintf(path, sizeof(path), "%s/name", de->d_name);
+			if (!readAttr(dirfd(dir), path, buf, sizeof(buf)) || strcmp(buf, name))
+				continue;
+
+			fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		closedir(dir);
+
+		if (fd >= 0 || created)
+			return fd;
+
+		snprintf(path, sizeof(path), "%s/%s", IIO_HRTIMER_DIR, name);
+		if (mkdir(path, 0755) < 0)
+			return -1;
+		created = veTrue;
+	}
+}
+
+static veBool adcScanChannelType(AdcDevice *dev, const char *chan, AdcChannel *sc)
+{
+	char attr[64];
+	char buf[32];
+	char endian, sign;
+	unsigned bits, storage, shift;
+
+	snprintf(attr, sizeof(attr), "scan_elements/%s_type", chan);
+	if (!readAttr(dev->dirfd, attr, buf, sizeof(buf)))
+		return veFalse;
+
+	/* e.g. le:u12/16>>0 */
+	if (sscanf(buf, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage, &shift) != 5)
+		return veFalse;
+
+	if (storage % 8 || storage > 64 || bits > storage || !bits)
+		return veFalse;
+
+	sc->bytes = storage / 8;
+	sc->bits = bits;
+	sc->shift = shift;
+	sc->isSigned = sign == 's';
+	sc->bigEndian = endian == 'b';
+
+	return veTrue;
+}
+
+static int adcScanChannelIndex(AdcDevice *dev, const char *chan)
+{
+	char attr[64];
+	char buf[16];
+
+	snprintf(attr, sizeof(attr), "scan_elements/%s_index", chan);
+	if (!readAttr(dev->dirfd, attr, buf, sizeof(buf)))
+		return -1;
+
+	return strtol(buf, NULL, 0);
+}
+
+/* elements left enabled by an earlier user would shift the frame layout */
+static veBool adcScanDisableAll(AdcDevice *dev)
+{
+	char attr[300];
+	struct dirent *de;
+	veBool ok = veTrue;
+	DIR *dir;
+	int fd;
+
+	fd = openat(dev->dirfd, "scan_elements", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return veFalse;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return veFalse;
+	}
+
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+
+		if (len < 3 || strcmp(de->d_name + len - 3, "_en"))
+			continue;
+
+		snprintf(attr, sizeof(attr), "scan_elements/%s", de->d_name);
+		if (!writeAttr(dev->dirfd, attr, "0"))
+			ok = veFalse;
+	}
+	closedir(dir);
+
+	return ok;
+}
+
+/*
+ * Enable the scan elements and compute where each of them ends up in a
+ * frame. Elements are stored in scan index order, each aligned to its
+ * own storage size.
+ */
+static veBool adcScanSetup(AdcDevice *dev)
+{
+	int index[ADC_MAX_CHANNELS + 1];
+	AdcChannel ts;
+	char chan[32];
+	char attr[64];
+	unsigned offset = 0;
+	unsigned align = 1;
+	int scanIndex = -1;
+	int i;
+
+	if (!adcScanDisableAll(dev))
+		return veFalse;
+
+	for (i = 0; i < dev->channelCount; i++) {
+		AdcChannel *sc = &dev->channels[i];
+
+		snprintf(chan, sizeof(chan), "in_voltage%d", sc->pin);
+		snprintf(attr, sizeof(attr), "scan_elements/%s_en", chan);
+		index[i] = adcScanChannelIndex(dev, chan);
+		if (index[i] < 0 || !adcScanChannelType(dev, chan, sc) ||
+				!writeAttr(dev->dirfd, attr, "1"))
+			return veFalse;
+	}
+
+	/* the timestamp is optional, and only of use on the clock of the samples */
+	index[i] = -1;
+	if (adcScanChannelType(dev, "in_timestamp", &ts) &&
+			writeAttr(dev->dirfd, "current_timestamp_clock", "monotonic") &&
+			writeAttr(dev->dirfd, "scan_elements/in_timestamp_en", "1"))
+		index[i] = adcScanChannelIndex(dev, "in_timestamp");
+
+	for (;;) {
+		int next = -1;
+		unsigned bytes;
+
+		for (i = 0; i <= dev->channelCount; i++)
+			if (index[i] > scanIndex && (next < 0 || index[i] < index[next]))
+				next = i;
+
+		if (next < 0)
+			break;
+
+		bytes = next < dev->channelCount ? dev->channels[next].bytes : ts.bytes;
+		offset = (offset + bytes - 1) / bytes * bytes;
+		if (next < dev->channelCount)
+			dev->channels[next].offset = offset;
+		else
+			dev->timestampOffset = offset;
+		offset += bytes;
+		if (bytes > align)
+			align = bytes;
+		scanIndex = index[next];
+	}
+
+	dev->frameSize = (offset + align - 1) / align * align;
+
+	return veTrue;
+}
+
+/*
+ * A hrtimer trigger runs at the rate given, or else fills the buffer up
+ * to the watermark once per sample period.
+ */
+static veBool adcTriggerRate(AdcDevice *dev, int trigger)
+{
+	unsigned rate = dev->rate;
+	char buf[16];
+
+	if (faccessat(trigger, "sampling_frequency", W_OK, 0) < 0) {
+		if (rate)
+			logE("adc", "%s: trigger '%s' has no rate", dev->name, dev->trigger);
+		return !rate;
+	}
+
+	if (!rate && dev->samplePeriod)
+		rate = (dev->watermark * 1000 + dev->samplePeriod - 1) / dev->samplePeriod;
+
+	if (!rate)
+		return veTrue;
+
+	snprintf(buf, sizeof(buf), "%u", rate);
+	if (!writeAttr(trigger, "sampling_frequency", buf))
+		return veFalse;
+
+	logI("adc", "%s: trigger '%s' at %u Hz", dev->name, dev->trigger, rate);
+
+	return veTrue;
+}
+
+static veBool adcBufferOpen(AdcDevice *dev)
+{
+	char buf[sizeof(dev->name) + 5]; /* "/dev/" and the name */
+	int trigger;
+
+	if (!dev->channelCount)
+		return veFalse;
+
+	writeAttr(dev->dirfd, "buffer/enable", "0");
+
+	if (!adcScanSetup(dev))
+		return veFalse;
+
+	snprintf(buf, sizeof(buf), "%u", dev->bufLength);
+	if (!writeAttr(dev->dirfd, "buffer/length", buf))
+		return veFalse;
+
+	/* number of scans before the buffer becomes readable */
+	if (!dev->watermark)
+		dev->watermark = (dev->bufLength + 1) / 2;
+	snprintf(buf, sizeof(buf), "%u", dev->watermark);
+	writeAttr(dev->dirfd, "buffer/watermark", buf);
+
+	if (dev->trigger[0]) {
+		trigger = adcTriggerOpen(dev->trigger);
+		if (trigger < 0) {
+			logE("adc", "%s: no trigger '%s'", dev->name, dev->trigger);
+			return veFalse;
+		}
+
+		/* sysfs triggers are fired by us, once per tick */
+		dev->triggerFd = openat(trigger, "trigger_now", O_WRONLY | O_CLOEXEC);
+
+		if (!adcTriggerRate(dev, trigger)) {
+			close(trigger);
+			return veFalse;
+		}
+		close(trigger);
+
+		if (!writeAttr(dev->dirfd, "trigger/current_trigger", dev->trigger))
+			return veFalse;
+	}
+
+	if (!writeAttr(dev->dirfd, "buffer/enable", "1"))
+		return veFalse;
+
+	snprintf(buf, sizeof(buf), "/dev/%s", dev->name);
+	dev->bufFd = open(buf, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (dev->bufFd < 0) {
+		logE("adc", "%s: %s", buf, strerror(errno));
+		writeAttr(dev->dirfd, "buffer/enable", "0");
+		return veFalse;
+	}
+
+	return veTrue;
+}
+
+/**
+ * @brief the registered iio devices
+ * @return Pointer to the first device, continued through dev->next
+ */
+AdcDevice *adcDeviceList(void)
+{
+	return devices;
+}
+
+static void adcDeviceCycle(AdcDevice *dev);
+
+static void *adcWorker(void *ctx)
+{
+	AdcDevice *dev = ctx;
+	uint64_t one = 1;
+
+	/* busy stays set until the main loop took the results */
+	pthread_mutex_lock(&dev->lock);
+	for (;;) {
+		while (!dev->run)
+			pthread_cond_wait(&dev->cond, &dev->lock);
+		dev->run = veFalse;
+		pthread_mutex_unlock(&dev->lock);
+
+		adcDeviceCycle(dev);
+
+		pthread_mutex_lock(&dev->lock);
+		if (write(dev->doneFd, &one, sizeof(one)) != sizeof(one))
+			logE("adc", "%s: %s", dev->name, strerror(errno));
+	}
+
+	return NULL;
+}
+
+static veBool adcWorkerStart(AdcDevice *dev)
+{
+	dev->doneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dev->doneFd < 0)
+		return veFalse;
+
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->cond, NULL);
+
+	if (pthread_create(&dev->thread, NULL, adcWorker, dev)) {
+		close(dev->doneFd);
+		dev->doneFd = -1;
+		return veFalse;
+	}
+
+	return veTrue;
+}
+
+/**
+ * @brief counts the devices whose reads may block
+ * @return the number of devices read from sysfs, or to be
+ */
+int adcDevicesMayBlock(void)
+{
+	AdcDevice *dev;
+	int n = 0;
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (dev->backend ? dev->backend->mayBlock : !dev->bufLength)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * @brief opens the backends of the devices
+ * @param workers - read the devices on threads of their own
+ *
+ * A device with a buffer length is captured through its buffer, other
+ * devices are read from sysfs, unless they were created with a backend
+ * of their own. Devices on which the buffer cannot be set up fall back to reading
+ * the channels one by one from sysfs. Buffers running from a trigger
+ * of their own are read when they become readable, the others when
+ * the sensors are ticked.
+ *
+ * With workers and more than one device, the sysfs reads of each device
+ * run on a thread of their own, so a slow or hung adc only delays its
+ * own inputs. Buffer and replay reads never block and are done inline.
+ * The workers are started anyway when a buffer fell back to sysfs and
+ * more than one device may block.
+ */
+void adcDevicesStart(veBool workers)
+{
+	AdcDevice *dev;
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (!dev->backend)
+			dev->backend = dev->bufLength ? &adcBufferBackend : &adcSysfsBackend;
+
+		if (!dev->backend->open(dev)) {
+			logE("adc", "%s: %s backend failed, using sysfs", dev->name, dev->backend->name);
+			dev->backend->close(dev);
+			dev->backend = &adcSysfsBackend;
+			dev->backend->open(dev);
+		}
+
+		dev->buffered = dev->backend == &adcBufferBackend;
+		dev->wakeOnData = dev->buffered && dev->triggerFd < 0;
+		if (dev->buffered)
+			logI("adc", "%s: buffered capture, %u channels, %u byte frames",
+				 dev->name, dev->channelCount, dev->frameSize);
+	}
+
+	if (!workers && adcDevicesMayBlock() > 1) {
+		logE("adc", "more than one device read from sysfs, starting workers");
+		workers = veTrue;
+	}
+
+	if (!workers || !devices || !devices->next)
+		return;
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (!dev->backend->mayBlock)
+			continue;
+
+		dev->threaded = adcWorkerStart(dev);
+		if (!dev->threaded)
+			logE("adc", "%s: no worker thread, reading inline", dev->name);
+	}
+}
+
+/**
+ * @brief checks whether a read cycle of the device is still running
+ * @param dev - pointer to the device struct
+ * @return veTrue from a request until its results are taken, see adcDeviceRelease()
+ */
+veBool adcDeviceBusy(AdcDevice *dev)
+{
+	veBool busy;
+
+	if (!dev->threaded)
+		return veFalse;
+
+	pthread_mutex_lock(&dev->lock);
+	busy = dev->busy;
+	pthread_mutex_unlock(&dev->lock);
+
+	return busy;
+}
+
+/**
+ * @brief reads the channels of the device which are marked due
+ * @param dev - pointer to the device struct
+ *
+ * For a threaded device the cycle is handed to its worker and doneFd
+ * becomes readable when it has finished, see adcDeviceDone(). Otherwise
+ * the results are available on return.
+ */
+void adcDeviceRequest(AdcDevice *dev)
+{
+	if (!dev->threaded) {
+		adcDeviceCycle(dev);
+		return;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	dev->busy = veTrue;
+	dev->run = veTrue;
+	pthread_cond_signal(&dev->cond);
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/**
+ * @brief acknowledges the completion of a threaded read cycle
+ * @param dev - pointer to the device struct
+ *
+ * The results are visible on return. The device stays busy until they
+ * are taken, see adcDeviceRelease(), so no new cycle rewrites them.
+ */
+void adcDeviceDone(AdcDevice *dev)
+{
+	uint64_t n;
+
+	if (read(dev->doneFd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		logE("adc", "%s: %s", dev->name, strerror(errno));
+
+	/* pairs with the worker's unlock, the results are visible after this */
+	pthread_mutex_lock(&dev->lock);
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/**
+ * @brief marks the results of a threaded read cycle as taken
+ * @param dev - pointer to the device struct
+ */
+void adcDeviceRelease(AdcDevice *dev)
+{
+	pthread_mutex_lock(&dev->lock);
+	dev->busy = veFalse;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static int64_t adcScanElement(const un8 *p, unsigned bytes, veBool bigEndian)
+{
+	uint64_t v = 0;
+	unsigned i;
+
+	for (i = 0; i < bytes; i++)
+		v |= (uint64_t) p[bigEndian ? i : bytes - 1 - i] << (8 * (bytes - 1 - i));
+
+	return v;
+}
+
+static void adcDemux(AdcDevice *dev, const un8 *frame)
+{
+	int i;
+
+	for (i = 0; i < dev->channelCount; i++) {
+		AdcChannel *sc = &dev->channels[i];
+		uint64_t v = adcScanElement(frame + sc->offset, sc->bytes, sc->bigEndian);
+		int64_t val;
+
+		v >>= sc->shift;
+		if (sc->bits < 64)
+			v &= (1ULL << sc->bits) - 1;
+
+		val = v;
+		if (sc->isSigned && sc->bits < 64 && (v & (1ULL << (sc->bits - 1))))
+			val -= 1LL << sc->bits;
+
+		sc->sum += val;
+		sc->count++;
+	}
+
+	if (dev->timestampOffset >= 0) {
+		dev->timestamp = adcScanElement(frame + dev->timestampOffset, 8, veFalse);
+		if (!dev->scans)
+			dev->firstTimestamp = dev->timestamp;
+	}
+	dev->scans++;
+}
+
+/*
+ * Read all frames captured since the last call from a buffered device.
+ * The samples of each channel are averaged over the batch, the value
+ * is then picked up by adcRead().
+ */
+static void adcDeviceRead(AdcDevice *dev)
+{
+	un8 buf[4096];
+	unsigned frames = sizeof(buf) / dev->frameSize;
+	int i, n;
+
+	for (i = 0; i < dev->channelCount; i++) {
+		dev->channels[i].sum = 0;
+		dev->channels[i].count = 0;
+	}
+	dev->scans = 0;
+
+	if (!frames)
+		return;
+
+	for (;;) {
+		n = read(dev->bufFd, buf, frames * dev->frameSize);
+		if (n <= 0)
+			break;
+
+		for (i = 0; i + dev->frameSize <= (unsigned) n; i += dev->frameSize)
+			adcDemux(dev, buf + i);
+
+		if ((unsigned) n < frames * dev->frameSize)
+			break;
+	}
+
+	if (n < 0 && errno != EAGAIN)
+		logE("adc", "%s: %s", dev->name, strerror(errno));
+
+	/* request the frame for the next tick */
+	if (dev->triggerFd >= 0 && pwrite(dev->triggerFd, "1", 1, 0) != 1)
+		logE("adc", "%s: trigger_now: %s", dev->name, strerror(errno));
+}
+
+static veBool adcScanValue(un32 *value, AdcChannel *chan)
+{
+	int64_t mean;
+
+	if (!chan->count)
+		return veFalse;
+
+	mean = chan->sum / (int64_t) chan->count;
+	*value = mean < 0 ? 0 : mean;
+
+	return veTrue;
+}
+
+/**
+ * @brief opens the sysfs value file of an adc channel
+ * @param chan - pointer to channel struct
  * @return - veTrue on success, veFalse on error
+ *
+ * The file is kept open and re-read with pread(), so a sample costs a
+ * single syscall instead of a path lookup, open, read and close.
  */
-veBool adcRead(un32 *value, AnalogSensor *sensor)
+veBool adcOpen(AdcChannel *chan)
 {
 	char file[64];
-	char val[16];
-	int fd;
-	int n;
 
-	snprintf(file, sizeof(file), "in_voltage%d_raw",
-			 sensor->interface.adcPin);
+	if (chan->fd >= 0)
+		return veTrue;
 
-	fd = openat(sensor->interface.devfd, file, O_RDONLY);
-	if (fd < 0) {
+	snprintf(file, sizeof(file), "in_voltage%d_raw", chan->pin);
+
+	STAT_INC(chan->stats.syscalls);
+	chan->fd = openat(chan->dev->dirfd, file, O_RDONLY | O_CLOEXEC);
+	if (chan->fd < 0) {
+		STAT_INC(chan->stats.errors);
 		perror(file);
 		return veFalse;
 	}
 
-	n = read(fd, val, sizeof(val));
-	close(fd);
+	return veTrue;
+}
 
-	if (n <= 0)
+/**
+ * @brief closes the sysfs value file of an adc channel
+ * @param chan - pointer to channel struct
+ */
+void adcClose(AdcChannel *chan)
+{
+	if (chan->fd < 0)
+		return;
+
+	STAT_INC(chan->stats.syscalls);
+	close(chan->fd);
+	chan->fd = -1;
+}
+
+static int adcReadRaw(AdcChannel *chan, char *val, size_t len)
+{
+	STAT_INC(chan->stats.syscalls);
+	return pread(chan->fd, val, len, 0);
+}
+
+/**
+ * @brief performs an adc sample read
+ * @param value - a pointer to the variable which will store the result
+ * @param chan - pointer to channel struct
+ * @return - veTrue on success, veFalse on error
+ *
+ * When the read fails, e.g. with ENODEV after the driver was rebound,
+ * the file is reopened and the read retried once.
+ */
+veBool adcRead(un32 *value, AdcChannel *chan)
+{
+	char val[16];
+	int n;
+
+	if (!adcOpen(chan))
+		return veFalse;
+
+	n = adcReadRaw(chan, val, sizeof(val));
+	if (n < 0) {
+		STAT_INC(chan->stats.errors);
+		adcClose(chan);
+		if (!adcOpen(chan))
+			return veFalse;
+		STAT_INC(chan->stats.reopens);
+		n = adcReadRaw(chan, val, sizeof(val));
+	}
+
+	if (n <= 0) {
+		STAT_INC(chan->stats.errors);
 		return veFalse;
+	}
 
-	if (val[n - 1] != '\n')
+	if (val[n - 1] != '\n') {
+		STAT_INC(chan->stats.errors);
 		return veFalse;
+	}
 
 	*value = strtoul(val, NULL, 0);
 
 	return veTrue;
 }
 
+static veBool adcSysfsOpen(AdcDevice *dev)
+{
+	int i;
+
+	/* a missing channel is retried on every read */
+	for (i = 0; i < dev->channelCount; i++)
+		adcOpen(&dev->channels[i]);
+
+	return veTrue;
+}
+
+/**
+ * @brief the time stamp of the samples
+ * @return CLOCK_MONOTONIC in ns
+ */
+uint64_t adcTimeNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void adcLatency(AdcChannel *chan, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i = 0;
+
+	while (us >= 4 && i < ADC_LATENCY_BUCKETS - 1) {
+		us >>= 2;
+		i++;
+	}
+
+	STAT_INC(chan->stats.latency[i]);
+}
+
+static void adcSysfsRead(AdcDevice *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->channelCount; i++) {
+		AdcChannel *chan = &dev->channels[i];
+		uint64_t start;
+
+		if (!chan->due)
+			continue;
+
+		start = adcTimeNs();
+		chan->ok = adcRead(&chan->value, chan);
+		chan->time = adcTimeNs();
+		adcLatency(chan, chan->time - start);
+		STAT_INC(chan->stats.reads);
+		chan->due = veFalse;
+	}
+}
+
+static void adcSysfsClose(AdcDevice *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->channelCount; i++)
+		adcClose(&dev->channels[i]);
+}
+
+// every channel read on its own from in_voltageN_raw
+const AdcBackend adcSysfsBackend = {
+	"sysfs", veTrue, adcSysfsOpen, adcSysfsRead, adcSysfsClose
+};
+
+/*
+ * The scans of a batch are averaged, so with kernel timestamps, which
+ * are evenly spaced by the trigger, the sample is stamped with the middle
+ * of the batch instead of the time it happened to be read.
+ */
+static void adcBufferRead(AdcDevice *dev)
+{
+	uint64_t time;
+	int i;
+
+	adcDeviceRead(dev);
+	if (dev->timestampOffset >= 0 && dev->scans)
+		time = dev->firstTimestamp + (dev->timestamp - dev->firstTimestamp) / 2;
+	else
+		time = adcTimeNs();
+
+	for (i = 0; i < dev->channelCount; i++) {
+		AdcChannel *chan = &dev->channels[i];
+
+		if (!chan->due)
+			continue;
+
+		chan->ok = adcScanValue(&chan->value, chan);
+		chan->time = time;
+		STAT_INC(chan->stats.reads);
+		chan->due = veFalse;
+	}
+}
+
+static void adcBufferClose(AdcDevice *dev)
+{
+	writeAttr(dev->dirfd, "buffer/enable", "0");
+
+	if (dev->bufFd >= 0)
+		close(dev->bufFd);
+	dev->bufFd = -1;
+
+	if (dev->triggerFd >= 0)
+		close(dev->triggerFd);
+	dev->triggerFd = -1;
+}
+
+// all channels at once, from /dev/iio:deviceN
+const AdcBackend adcBufferBackend = {
+	"buffer", veFalse, adcBufferOpen, adcBufferRead, adcBufferClose
+};
+
+static void adcDeviceCycle(AdcDevice *dev)
+{
+	dev->backend->readBatch(dev);
+}
+
+/**
+ * @brief the coefficient of the single pole IIR low pass filter
+ * @param fc - cutoff frequency in Hz
+ * @param period - sample period in seconds
+ * @return the smoothing factor alpha for adcFilter()
+ */
+float adcFilterAlpha(float fc, float period)
+{
+	return 1.0f - expf(-2.0f * (float) M_PI * fc * period);
+}
+
 /**
  * @brief a single pole IIR low pass filter
  * @param x - the current sample
@@ -49,8 +907,155 @@ veBool adcRead(un32 *value, AnalogSensor *sensor)
  */
 float adcFilter(float x, FilerIirLpf *f)
 {
-	if (f->FF && fabs(f->last - x) > f->FF)
+	if (f->FF && fabsf(f->last - x) > f->FF)
 		f->last = x;
 
-	return f->last += (x - f->last) * 2 * M_PI * f->fc;
+	return f->last += (x - f->last) * f->alpha;
 }
+
+/**
+ * @brief scales and filters a batch of samples, scalar reference
+ * @param b - input samples and filter state
+ * @param n - number of lanes
+ *
+ * Lanes with update set get sampleRaw = value * scale and sample the
+ * output of adcFilter(), the others are left alone.
+ */
+void adcFilterBatchRef(const AdcFilterBatch *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		FilerIirLpf f;
+
+		if (!b->update[i])
+			continue;
+
+		f.FF = b->FF[i];
+		f.alpha = b->alpha[i];
+		f.last = b->last[i];
+
+		b->sampleRaw[i] = b->value[i] * b->scale[i];
+		if (f.FF && fabsf(f.last - b->sampleRaw[i]) > f.FF)
+			b->resets[i]++;
+		b->sample[i] = adcFilter(b->sampleRaw[i], &f);
+		b->last[i] = f.last;
+	}
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef sn32 v4i __attribute__((vector_size(16)));
+
+#define LOAD(v, p)		memcpy(&(v), (p), sizeof(v))
+#define STORE(p, v)		memcpy((p), &(v), sizeof(v))
+#define SELECT(m, a, b)	((v4f) (((v4i) (a) & (m)) | ((v4i) (b) & ~(m))))
+
+/**
+ * @brief scales and filters a batch of samples, four lanes at a time
+ * @param b - input samples and filter state
+ * @param n - number of lanes
+ *
+ * Gives bit identical results to adcFilterBatchRef().
+ */
+void adcFilterBatch(const AdcFilterBatch *b, int n)
+{
+	const v4f zero = { 0 };
+	const v4i sign = { INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN };
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v4i update, reset, resets;
+		v4f value, scale, ff, alpha, last, raw, sample, x, y, diff;
+
+		LOAD(update, b->update + i);
+		update = update != 0;
+		if (!(update[0] | update[1] | update[2] | update[3]))
+			continue;
+
+		LOAD(value, b->value + i);
+		LOAD(scale, b->scale + i);
+		LOAD(ff, b->FF + i);
+		LOAD(alpha, b->alpha + i);
+		LOAD(last, b->last + i);
+		LOAD(raw, b->sampleRaw + i);
+		LOAD(sample, b->sample + i);
+		LOAD(resets, b->resets + i);
+
+		x = value * scale;
+
+		/* fast follow on a step larger than FF */
+		diff = (v4f) ((v4i) (last - x) & ~sign);
+		reset = (ff != zero) & (diff > ff);
+		y = SELECT(reset, x, last);
+
+		y += (x - y) * alpha;
+
+		raw = SELECT(update, x, raw);
+		sample = SELECT(update, y, sample);
+		last = SELECT(update, y, last);
+		resets -= reset & update;
+
+		STORE(b->sampleRaw + i, raw);
+		STORE(b->sample + i, sample);
+		STORE(b->last + i, last);
+		STORE(b->resets + i, resets);
+	}
+
+	if (i < n) {
+		AdcFilterBatch tail = {
+			b->value + i, b->update + i, b->scale + i, b->FF + i, b->alpha + i,
+			b->last + i, b->sampleRaw + i, b->sample + i, b->resets + i
+		};
+		adcFilterBatchRef(&tail, n - i);
+	}
+}
+
+#else
+
+void adcFilterBatch(const AdcFilterBatch *b, int n)
+{
+	adcFilterBatchRef(b, n);
+}
+
+#endif
+
+#ifdef ADC_FIXED_POINT
+
+/**
+ * @brief scales and filters a batch of samples in fixed point
+ * @param b - input samples and filter state
+ * @param n - number of lanes
+ *
+ * The integer counterpart of adcFilterBatchRef(), it only uses 32 x 32
+ * bit multiplies.
+ */
+void adcFilterBatchFixed(const AdcFilterBatchFixed *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sn32 x, y;
+
+		if (!b->update[i])
+			continue;
+
+		x = (uint64_t) b->value[i] * b->scale[i] >> 24;
+		y = b->last[i];
+
+		/* fast follow on a step larger than FF */
+		if (y == Q_UNSET || (b->FF[i] && abs(y - x) > b->FF[i])) {
+			y = x;
+			b->resets[i]++;
+		}
+
+		y += ((int64_t) (x - y) * b->alpha[i] + Q30_ONE / 2) >> 30;
+
+		b->sampleRaw[i] = x;
+		b->sample[i] = y;
+		b->last[i] = y;
+	}
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensors.h"
+
+/**
+ * @brief allocates the filter stages of a sensor
+ * @param cfg - the stages to run, a length of 0 or 1 disables a stage
+ * @return Pointer to the filter chain, NULL if none of the stages is used
+ *
+ * All buffers are part of the chain, so filtering never allocates.
+ */
+FilterChain *filterChainCreate(const FilterConfig *cfg)
+{
+	FilterChain *c;
+	int i;
+
+	if (cfg->oversample <= 1 && cfg->median <= 1 && cfg->average <= 1 &&
+			cfg->poles <= 1)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->cfg = *cfg;
+	for (i = 0; i < FILTER_MAX_POLES - 1; i++)
+		c->pole[i] = HUGE_VALF;
+
+	return c;
+}
+
+static float filterMedian(FilterChain *c, float x)
+{
+	float sorted[FILTER_MAX_MEDIAN];
+	int i, j;
+
+	c->medianBuf[c->medianPos] = x;
+	c->medianPos = (c->medianPos + 1) % c->cfg.median;
+	if (c->medianLen < c->cfg.median)
+		c->medianLen++;
+
+	/* insertion sort, the window is tiny */
+	for (i = 0; i < c->medianLen; i++) {
+		float v = c->medianBuf[i];
+
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+
+	return sorted[(c->medianLen - 1) / 2];
+}
+
+static float filterAverage(FilterChain *c, float x)
+{
+	if (c->averageLen == c->cfg.average)
+		c->averageSum -= c->averageBuf[c->averagePos];
+	else
+		c->averageLen++;
+
+	c->averageBuf[c->averagePos] = x;
+	c->averageSum += x;
+	c->averagePos = (c->averagePos + 1) % c->cfg.average;
+
+	return c->averageSum / c->averageLen;
+}
+
+/**
+ * @brief runs the stages ahead of the single pole IIR low pass
+ * @param c - pointer to the filter chain
+ * @param x - the sample, replaced by the output of the stages
+ * @return veFalse while the decimator is still collecting samples
+ *
+ * The oversampled input is decimated with a boxcar, passed through a
+ * median of K to reject spikes and then through a moving average.
+ */
+veBool filterChainIn(FilterChain *c, float *x)
+{
+	float v = *x;
+
+	if (c->cfg.oversample > 1) {
+		c->decimSum += v;
+		if (++c->decimCount < c->cfg.oversample)
+			return veFalse;
+
+		v = c->decimSum / c->decimCount;
+		c->decimSum = 0;
+		c->decimCount = 0;
+	}
+
+	if (c->cfg.median > 1)
+		v = filterMedian(c, v);
+
+	if (c->cfg.average > 1)
+		v = filterAverage(c, v);
+
+	*x = v;
+
+	return veTrue;
+}
+
+/**
+ * @brief runs the poles after the first of a multi-pole IIR low pass
+ * @param c - pointer to the filter chain
+ * @param y - the output of the first pole
+ * @param alpha - the coefficient of each pole, see adcFilterAlpha()
+ * @param FF - fast follow threshold, 0 to disable
+ * @return the filter output
+ */
+float filterChainOut(FilterChain *c, float y, float alpha, float FF)
+{
+	int i;
+
+	for (i = 0; i < c->cfg.poles - 1; i++) {
+		float *last = &c->pole[i];
+
+		if (*last == HUGE_VALF || (FF && fabsf(*last - y) > FF))
+			*last = y;
+
+		y = *last += (y - *last) * alpha;
+	}
+
+	return y;
+}
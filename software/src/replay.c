@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+#define REPLAY_MAX_ROWS		1000000
+#define REPLAY_MAX_COLUMNS	64
+
+/*
+ * A row of the trace is a scan of the device, the raw values of pin 0,
+ * 1, ... separated by white space or commas. Every row needs the same
+ * number of columns.
+ */
+static veBool adcReplayLoad(AdcDevice *dev, const char *file)
+{
+	char buf[1024];
+	unsigned size = 0;
+	int line = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		logE("replay", "cannot open %s", file);
+		return veFalse;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		un32 row[REPLAY_MAX_COLUMNS];
+		unsigned cols = 0;
+		char *p;
+
+		line++;
+
+		if (!strchr(buf, '\n') && !feof(f)) {
+			logE("replay", "%s:%d: line too long", file, line);
+			goto error;
+		}
+
+		p = strchr(buf, '#');
+		if (p)
+			*p = 0;
+
+		for (p = buf + strspn(buf, " \t,\r\n"); *p; p += strspn(p, " \t,\r\n")) {
+			char *end;
+
+			if (cols == REPLAY_MAX_COLUMNS) {
+				logE("replay", "%s:%d: more than %d columns", file, line, REPLAY_MAX_COLUMNS);
+				goto error;
+			}
+
+			row[cols++] = strtoul(p, &end, 0);
+			if (end == p) {
+				logE("replay", "%s:%d: invalid number", file, line);
+				goto error;
+			}
+			p = end;
+		}
+
+		if (!cols)
+			continue;
+
+		if (!dev->traceColumns)
+			dev->traceColumns = cols;
+
+		if (cols != dev->traceColumns) {
+			logE("replay", "%s:%d: %u columns, expected %u", file, line, cols, dev->traceColumns);
+			goto error;
+		}
+
+		if (dev->traceRows == REPLAY_MAX_ROWS) {
+			logE("replay", "%s: more than %d rows", file, REPLAY_MAX_ROWS);
+			goto error;
+		}
+
+		if (dev->traceRows == size) {
+			un32 *trace;
+
+			size = size ? 2 * size : 256;
+			trace = realloc(dev->trace, size * cols * sizeof(*trace));
+			if (!trace) {
+				logE("replay", "out of memory");
+				goto error;
+			}
+			dev->trace = trace;
+		}
+
+		memcpy(dev->trace + dev->traceRows * cols, row, cols * sizeof(*row));
+		dev->traceRows++;
+	}
+
+	fclose(f);
+
+	if (!dev->traceRows) {
+		logE("replay", "%s: no samples", file);
+		return veFalse;
+	}
+
+	logI("replay", "%s: %u scans of %u channels", file, dev->traceRows, dev->traceColumns);
+
+	return veTrue;
+
+error:
+	fclose(f);
+	return veFalse;
+}
+
+/**
+ * @brief creates a device replaying recorded samples
+ * @param file - the trace, see adcReplayLoad()
+ * @return Pointer to the device struct, NULL on error
+ *
+ * Every read cycle returns the next row of the trace, starting over at
+ * the end, so the sensors can be run without the hardware.
+ */
+AdcDevice *adcReplayCreate(const char *file)
+{
+	char name[sizeof("replay") + 11]; /* any int */
+	AdcDevice *dev;
+	int n = 0;
+
+	for (dev = adcDeviceList(); dev; dev = dev->next) {
+		if (dev->backend != &adcReplayBackend)
+			continue;
+		if (!strcmp(dev->traceFile, file))
+			return dev;
+		n++;
+	}
+
+	/* the name ends up in the settings path, the file name can't */
+	snprintf(name, sizeof(name), "replay%d", n);
+	dev = adcDeviceCreate(name, -1);
+	if (!dev)
+		return NULL;
+
+	dev->traceFile = strdup(file);
+	if (!dev->traceFile || !adcReplayLoad(dev, file)) {
+		free(dev->traceFile);
+		free(dev->trace);
+		dev->traceFile = NULL;
+		dev->trace = NULL;
+		dev->traceRows = 0;
+		dev->traceColumns = 0;
+		return NULL;
+	}
+
+	dev->backend = &adcReplayBackend;
+	logI("replay", "%s replays %s", dev->name, file);
+
+	return dev;
+}
+
+static veBool adcReplayOpen(AdcDevice *dev)
+{
+	return veTrue;
+}
+
+static void adcReplayRead(AdcDevice *dev)
+{
+	const un32 *row = dev->trace + dev->tracePos * dev->traceColumns;
+	uint64_t time = adcTimeNs();
+	int i;
+
+	for (i = 0; i < dev->channelCount; i++) {
+		AdcChannel *chan = &dev->channels[i];
+
+		if (!chan->due)
+			continue;
+
+		chan->ok = (unsigned) chan->pin < dev->traceColumns;
+		if (chan->ok)
+			chan->value = row[chan->pin];
+		chan->time = time;
+		STAT_INC(chan->stats.reads);
+		chan->due = veFalse;
+	}
+
+	if (++dev->tracePos == dev->traceRows)
+		dev->tracePos = 0;
+}
+
+static void adcReplayClose(AdcDevice *dev)
+{
+}
+
+// recorded samples, for tests and benchmarks
+const AdcBackend adcReplayBackend = {
+	"replay", veFalse, adcReplayOpen, adcReplayRead, adcReplayClose
+};
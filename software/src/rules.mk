@@ -1,3 +1,9 @@
 SRCS += task.c
 SRCS += adc.c
 SRCS += sensors.c
+SRCS += filter.c
+SRCS += tankshape.c
+SRCS += strapping.c
+SRCS += tempmodel.c
+SRCS += replay.c
+SRCS += acquire.c
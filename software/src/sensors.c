@@ -1,6 +1,10 @@
+#include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <velib/platform/plt.h>
 #include <velib/types/ve_dbus_item.h>
@@ -11,8 +15,12 @@
 
 #include "sensors.h"
 
-#define MAX_SENSORS							8
-#define SAMPLE_RATE							10
+// default sample and publish periods in ms
+#define SENSOR_SAMPLE_PERIOD				100
+#define SENSOR_PUBLISH_PERIOD				1000
+#define SENSOR_HEARTBEAT					60000
+#define SENSOR_DEBUG_PERIOD					10000
+#define SENSOR_RING_CYCLES					16 // read cycles queued for the main loop
 
 // defines for the tank level sensor analog front end parameters
 #define TANK_SENS_VREF						5.0
@@ -38,19 +46,59 @@
 
 // defines to tank level sensor filter parameters
 #define TANK_SENSOR_IIR_LPF_FF_VALUE		0.4
-#define TANK_SENSOR_CUTOFF_FREQ				(0.001 / SAMPLE_RATE)
+#define TANK_SENSOR_CUTOFF_FREQ				0.001f // Hz
 
 // defines to temperature sensor filter parameters
 #define TEMPERATURE_SENSOR_IIR_LPF_FF_VALUE	0.2
-#define TEMPERATURE_SENSOR_CUTOFF_FREQ		(0.01 / SAMPLE_RATE)
+#define TEMPERATURE_SENSOR_CUTOFF_FREQ		0.01f // Hz
+
+static SensorTable table;
+/* the acquisition thread, see sensorAcquire() */
+static int acquirePriority = -1;
+static int acquireFd = -1;
+static SampleRing acquireRing;
+
+// the Function settings still to come from localsettings, for the startup log
+static struct {
+	int pending;
+	uint64_t start;
+} settingsStats;
+
+// sensorTick() wall time and the item changes sent, for /Debug
+static struct {
+	uint64_t ns;
+	un32 count;
+	un32 maxNs;
+	uint64_t windowEnd; /* ms */
+	/* of the last whole window, as published */
+	un32 avgUs;
+	un32 maxUs;
+	un32 itemChanges;
+} tickStats;
+
+static Deadband deadbands[PUBLISH_COUNT] = {
+	[PUBLISH_STATUS]		= { 0, 0, SENSOR_HEARTBEAT },
+	[PUBLISH_LEVEL]			= { 0, 0, SENSOR_HEARTBEAT },
+	[PUBLISH_REMAINING]		= { 0, 0.001f, SENSOR_HEARTBEAT },
+	[PUBLISH_RESISTANCE]	= { 1.0f, 0, SENSOR_HEARTBEAT },
+	[PUBLISH_TEMPERATURE]	= { 0, 0, SENSOR_HEARTBEAT },
+	[PUBLISH_VOLTAGE]		= { 0.01f, 0, SENSOR_HEARTBEAT },
+};
 
-static AnalogSensor *sensors[MAX_SENSORS];
-static int sensorCount;
+static const char *publishNames[PUBLISH_COUNT] = {
+	[PUBLISH_STATUS]		= "Status",
+	[PUBLISH_LEVEL]			= "Level",
+	[PUBLISH_REMAINING]		= "Remaining",
+	[PUBLISH_RESISTANCE]	= "Resistance",
+	[PUBLISH_TEMPERATURE]	= "Temperature",
+	[PUBLISH_VOLTAGE]		= "Voltage",
+};
 
 static VeVariantUnitFmt veUnitVolume = {3, "m3"};
 static VeVariantUnitFmt veUnitCelsius0Dec = {0, "C"};
 static VeVariantUnitFmt unitRes0Dec = {0, "ohm"};
 static VeVariantUnitFmt veUnitVolts = {2, "V"};
+static VeVariantUnitFmt unitHz4Dec = {4, "Hz"};
 
 /* Common */
 static struct VeSettingProperties functionProps = {
@@ -59,6 +107,20 @@ static struct VeSettingProperties functionProps = {
 	.max.value.SN32 = SENSOR_FUNCTION_COUNT - 1,
 };
 
+static struct VeSettingProperties tankFilterProps = {
+	.type = VE_FLOAT,
+	.def.value.Float = TANK_SENSOR_CUTOFF_FREQ,
+	.min.value.Float = 0.0001f,
+	.max.value.Float = 10.0f,
+};
+
+static struct VeSettingProperties temperatureFilterProps = {
+	.type = VE_FLOAT,
+	.def.value.Float = TEMPERATURE_SENSOR_CUTOFF_FREQ,
+	.min.value.Float = 0.0001f,
+	.max.value.Float = 10.0f,
+};
+
 /* Tank sensor */
 static struct VeSettingProperties tankCapacityProps = {
 	.type = VE_FLOAT,
@@ -167,6 +229,8 @@ static void onTankResConfigChanged(struct VeItem *item)
 	sn32 tankEmptyR, tankFullR;
 	struct VeItem *settingsItem;
 
+	tank->conv.valid = veFalse;
+
 	if (!veVariantIsValid(veItemLocalValue(tank->standardItem, &standard)))
 		return;
 
@@ -192,12 +256,72 @@ static void onTankResConfigChanged(struct VeItem *item)
 		veItemSet(settingsItem, veVariantSn32(&v, tankFullR));
 }
 
+static void onTankCapacityChanged(struct VeItem *item)
+{
+	struct TankSensor *tank = (struct TankSensor *) veItemCtx(item)->ptr;
+
+	tank->conv.valid = veFalse;
+}
+
+/* the low pass coefficient of lane n for samples dt us apart */
+static void sensorFilterAlpha(int n, un32 dt)
+{
+	table.filterDt[n] = dt;
+	table.filterAlpha[n] = adcFilterAlpha(table.sensor[n]->filterCutoff, dt / 1e6f);
+#ifdef ADC_FIXED_POINT
+	table.filterAlphaQ[n] = lrintf(table.filterAlpha[n] * Q30_ONE);
+#endif
+}
+
+static void sensorFilterUpdate(AnalogSensor *sensor)
+{
+	int n = sensor->index;
+	un32 period = table.samplePeriod[n] * 1000;
+
+	/* the low pass runs on the decimated samples */
+	if (table.filterChain[n] && table.filterChain[n]->cfg.oversample > 1)
+		period *= table.filterChain[n]->cfg.oversample;
+
+	sensorFilterAlpha(n, period);
+#ifdef ADC_FIXED_POINT
+	table.filterFFQ[n] = lrintf(table.filterFF[n] * Q24_ONE);
+#endif
+}
+
+static void onFilterChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (!veVariantIsValid(veItemLocalValue(item, &v)))
+		return;
+
+	sensor->filterCutoff = v.value.Float;
+	sensorFilterUpdate(sensor);
+}
+
+static struct VeItem *createFilterProxy(AnalogSensor *sensor, char const *prefix,
+										struct VeSettingProperties *properties)
+{
+	struct VeItem *item;
+
+	item = createSettingsProxy(sensor, prefix, "FilterCutoff", veVariantFmt, &unitHz4Dec, properties, NULL);
+	veItemCtx(item)->ptr = sensor;
+	veItemSetChanged(item, onFilterChanged);
+
+	return item;
+}
+
 static void onTankShapeChanged(struct VeItem *item)
 {
 	struct TankSensor *tank = (struct TankSensor *) veItemCtx(item)->ptr;
+	float points[TANK_SHAPE_MAX_POINTS + 1][2];
 	VeVariant shape;
 	const char *map;
-	int i;
+	int n;
+
+	if (tank->strapped)
+		return;
 
 	if (!veVariantIsValid(veItemLocalValue(tank->shapeItem, &shape))) {
 		logE("tank", "invalid shape value");
@@ -209,48 +333,41 @@ static void onTankShapeChanged(struct VeItem *item)
 	if (!map[0])
 		goto reset;
 
-	tank->shapeMap[0][0] = 0;
-	tank->shapeMap[0][1] = 0;
-	i = 1;
-
-	while (i < TANK_SHAPE_MAX_POINTS) {
-		unsigned int s, l;
+	n = tankShapeParse(map, points);
+	if (!n)
+		goto reset;
 
-		if (sscanf(map, "%u:%u", &s, &l) < 2) {
-			logE("tank", "malformed shape spec");
-			goto reset;
-		}
+	tankShapeCompile(tank, points, n);
 
-		if (s < 1 || s > 99 || l < 1 || l > 99) {
-			logE("tank", "shape level out of range 1-99");
-			goto reset;
-		}
+	return;
 
-		if (s <= tank->shapeMap[i - 1][0] ||
-			l <= tank->shapeMap[i - 1][1]) {
-			logE("tank", "shape level non-increasing");
-			goto reset;
-		}
+reset:
+	tank->hasShape = veFalse;
+}
 
-		tank->shapeMap[i][0] = s / 100.0;
-		tank->shapeMap[i][1] = l / 100.0;
-		i++;
+static void createDebugItems(AnalogSensor *sensor)
+{
+	SensorPerf *perf = &sensor->perf;
+	struct VeItem *root = sensor->root;
+	VeVariant v;
+	int i;
 
-		map = strchr(map, ',');
-		if (!map)
-			break;
+	perf->reads.item = veItemCreateBasic(root, "Debug/Reads", veVariantInvalidType(&v, VE_UN32));
+	perf->readErrors.item = veItemCreateBasic(root, "Debug/ReadErrors", veVariantInvalidType(&v, VE_UN32));
+	perf->reopens.item = veItemCreateBasic(root, "Debug/Reopens", veVariantInvalidType(&v, VE_UN32));
+	perf->syscalls.item = veItemCreateBasic(root, "Debug/Syscalls", veVariantInvalidType(&v, VE_UN32));
+	for (i = 0; i < ADC_LATENCY_BUCKETS; i++) {
+		char id[32];
 
-		map++;
+		snprintf(id, sizeof(id), "Debug/ReadLatency/%d", i);
+		perf->readLatency[i].item = veItemCreateBasic(root, id, veVariantInvalidType(&v, VE_UN32));
 	}
-
-	tank->shapeMap[i][0] = 1;
-	tank->shapeMap[i][1] = 1;
-	tank->shapeMapLen = i + 1;
-
-	return;
-
-reset:
-	tank->shapeMapLen = 0;
+	perf->filterResets.item = veItemCreateBasic(root, "Debug/FilterResets", veVariantInvalidType(&v, VE_UN32));
+	perf->overrunsItem.item = veItemCreateBasic(root, "Debug/Overruns", veVariantInvalidType(&v, VE_UN32));
+	perf->lostItem.item = veItemCreateBasic(root, "Debug/LostSamples", veVariantInvalidType(&v, VE_UN32));
+	perf->messagesItem.item = veItemCreateBasic(root, "Debug/Messages", veVariantInvalidType(&v, VE_UN32));
+	perf->tickTime.item = veItemCreateBasic(root, "Debug/TickTime", veVariantInvalidType(&v, VE_UN32));
+	perf->tickTimeMax.item = veItemCreateBasic(root, "Debug/TickTimeMax", veVariantInvalidType(&v, VE_UN32));
 }
 
 static void createItems(AnalogSensor *sensor, const char *driver)
@@ -270,12 +387,10 @@ static void createItems(AnalogSensor *sensor, const char *driver)
 	sensor->statusItem = createEnumItem(sensor, "Status", veVariantUn32(&v, SENSOR_STATUS_NOT_CONNECTED), &statusDef, NULL);
 
 	/* must be a valid dbus path.. */
-	snprintf(prefix, sizeof(prefix), "Settings/Devices/adc_%s_%d", driver, sensor->interface.adcPin);
-	p = prefix;
-	while (*p) {
-		if (*p == ':')
+	snprintf(prefix, sizeof(prefix), "Settings/Devices/adc_%s_%d", driver, table.channel[sensor->index]->pin);
+	for (p = prefix + strlen("Settings/Devices/"); *p; p++) {
+		if (!isalnum((unsigned char) *p) && *p != '_')
 			*p = '_';
-		p++;
 	}
 	createSettingsProxy(sensor, prefix, "CustomName", veVariantFmt, &veUnitNone, &emptyStrType, NULL);
 
@@ -291,6 +406,8 @@ static void createItems(AnalogSensor *sensor, const char *driver)
 
 		snprintf(prefix, sizeof(prefix), "Settings/Tank/%d", sensor->number);
 		tank->capacityItem = createSettingsProxy(sensor, prefix, "Capacity", veVariantFmt, &veUnitVolume, &tankCapacityProps, NULL);
+		veItemCtx(tank->capacityItem)->ptr = tank;
+		veItemSetChanged(tank->capacityItem, onTankCapacityChanged);
 		tank->fluidTypeItem = createSettingsProxy(sensor, prefix, "FluidType2", veVariantEnumFmt, &fluidTypeDef, &tankFluidType, "FluidType");
 
 		/* The callback will make sure these are kept in sync */
@@ -310,8 +427,7 @@ static void createItems(AnalogSensor *sensor, const char *driver)
 		veItemCtx(tank->shapeItem)->ptr = tank;
 		veItemSetChanged(tank->shapeItem, onTankShapeChanged);
 
-		sensor->function = createFunctionProxy(sensor, "Settings/AnalogInput/Resistive/%d");
-
+		sensor->filterItem = createFilterProxy(sensor, prefix, &tankFilterProps);
 	} else if (sensor->sensorType == SENSOR_TYPE_TEMP) {
 		struct TemperatureSensor *temperature = (struct TemperatureSensor *) sensor;
 
@@ -325,24 +441,67 @@ static void createItems(AnalogSensor *sensor, const char *driver)
 		temperature->scaleItem = createSettingsProxy(sensor, prefix, "Scale", veVariantFmt, &veUnitNone, &scaleProps, NULL);
 		temperature->offsetItem = createSettingsProxy(sensor, prefix, "Offset", veVariantFmt, &veUnitNone, &offsetProps, NULL);
 		createSettingsProxy(sensor, prefix, "TemperatureType2", veVariantFmt, &veUnitNone, &temperatureType, "TemperatureType");
+		sensor->filterItem = createFilterProxy(sensor, prefix, &temperatureFilterProps);
+	}
+
+	createDebugItems(sensor);
+	sensor->itemsCreated = veTrue;
+}
+
+/*
+ * The settings are registered without waiting for the replies, so log
+ * when the last of them arrived, which is when startup really ends.
+ */
+static void onFunctionChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+
+	if (sensor->functionArrived)
+		return;
+	sensor->functionArrived = veTrue;
+
+	if (--settingsStats.pending == 0)
+		logI("sensors", "settings of %d inputs arrived after %u ms", table.count,
+			 (unsigned) ((adcTimeNs() - settingsStats.start) / 1000000));
+}
+
+/*
+ * Only the Function setting is needed to know whether an input is used,
+ * the rest of the items and settings are created when it is enabled.
+ * Most inputs are typically unused, so this saves the settings round
+ * trips and memory for them.
+ */
+static void createFunctionItem(AnalogSensor *sensor)
+{
+	if (!settingsStats.pending++)
+		settingsStats.start = adcTimeNs();
 
+	if (sensor->sensorType == SENSOR_TYPE_TANK)
+		sensor->function = createFunctionProxy(sensor, "Settings/AnalogInput/Resistive/%d");
+	else if (sensor->sensorType == SENSOR_TYPE_TEMP)
 		sensor->function = createFunctionProxy(sensor, "Settings/AnalogInput/Temperature/%d");
-	}
+
+	veItemCtx(sensor->function)->ptr = sensor;
+	veItemSetChanged(sensor->function, onFunctionChanged);
 }
 
 static void tankInit(AnalogSensor *sensor)
 {
 	SensorDbusInterface *dbus = &sensor->interface.dbus;
-	FilerIirLpf *lpf = &sensor->interface.sigCond.filterIirLpf;
+	int n = sensor->index;
 
 	static int tankNum = 1;
 
-	lpf->FF = TANK_SENSOR_IIR_LPF_FF_VALUE;
-	lpf->fc = TANK_SENSOR_CUTOFF_FREQ;
-	lpf->last = HUGE_VALF;
+	table.filterFF[n] = TANK_SENSOR_IIR_LPF_FF_VALUE;
+	table.filterLast[n] = HUGE_VALF;
+#ifdef ADC_FIXED_POINT
+	table.filterLastQ[n] = Q_UNSET;
+#endif
+	sensor->filterCutoff = TANK_SENSOR_CUTOFF_FREQ;
+	sensorFilterUpdate(sensor);
 
 	snprintf(dbus->service, sizeof(dbus->service),
-			 "com.victronenergy.tank.builtin_adc%d", sensor->interface.adcPin);
+			 "com.victronenergy.tank.builtin_adc%d", table.channel[sensor->index]->pin);
 
 	snprintf(sensor->ifaceName, sizeof(sensor->ifaceName),
 			 "Tank Level sensor input %d", tankNum);
@@ -354,16 +513,20 @@ static void tankInit(AnalogSensor *sensor)
 static void temperatureInit(AnalogSensor *sensor)
 {
 	SensorDbusInterface *dbus = &sensor->interface.dbus;
-	FilerIirLpf *lpf = &sensor->interface.sigCond.filterIirLpf;
+	int n = sensor->index;
 
 	static int tempNum = 1;
 
-	lpf->FF = TEMPERATURE_SENSOR_IIR_LPF_FF_VALUE;
-	lpf->fc = TEMPERATURE_SENSOR_CUTOFF_FREQ;
-	lpf->last = HUGE_VALF;
+	table.filterFF[n] = TEMPERATURE_SENSOR_IIR_LPF_FF_VALUE;
+	table.filterLast[n] = HUGE_VALF;
+#ifdef ADC_FIXED_POINT
+	table.filterLastQ[n] = Q_UNSET;
+#endif
+	sensor->filterCutoff = TEMPERATURE_SENSOR_CUTOFF_FREQ;
+	sensorFilterUpdate(sensor);
 
 	snprintf(dbus->service, sizeof(dbus->service),
-			 "com.victronenergy.temperature.builtin_adc%d", sensor->interface.adcPin);
+			 "com.victronenergy.temperature.builtin_adc%d", table.channel[sensor->index]->pin);
 
 	snprintf(sensor->ifaceName, sizeof(sensor->ifaceName),
 			 "Temperature sensor input %d", tempNum);
@@ -372,21 +535,69 @@ static void temperatureInit(AnalogSensor *sensor)
 	tempNum++;
 }
 
+/*
+ * A column that can't grow keeps its old block, so the table stays
+ * usable at its old size; the columns grown already are merely larger.
+ */
+#define GROW(a, n)	({ \
+		void *grown = realloc((a), (n) * sizeof(*(a))); \
+		if (grown) \
+			(a) = grown; \
+		grown != NULL; \
+	})
+
+static veBool sensorTableGrow(void)
+{
+	int size = table.size ? 2 * table.size : 8;
+
+	if (!GROW(table.sensor, size) || !GROW(table.channel, size) ||
+			!GROW(table.value, size) || !GROW(table.update, size) ||
+			!GROW(table.scale, size) || !GROW(table.sampleRaw, size) ||
+			!GROW(table.sample, size) || !GROW(table.filterFF, size) ||
+			!GROW(table.filterAlpha, size) || !GROW(table.filterLast, size) ||
+			!GROW(table.filterDt, size) || !GROW(table.filterTime, size) ||
+			!GROW(table.filterResets, size) ||
+			!GROW(table.filterChain, size) ||
+			!GROW(table.valid, size) || !GROW(table.pending, size) ||
+			!GROW(table.samplePeriod, size) ||
+			!GROW(table.nextSample, size))
+		return veFalse;
+
+#ifdef ADC_FIXED_POINT
+	if (!GROW(table.valueQ, size) || !GROW(table.scaleQ, size) ||
+			!GROW(table.filterFFQ, size) || !GROW(table.filterAlphaQ, size) ||
+			!GROW(table.filterLastQ, size) || !GROW(table.sampleRawQ, size) ||
+			!GROW(table.sampleQ, size))
+		return veFalse;
+#endif
+
+	table.size = size;
+
+	return veTrue;
+}
+
 /**
  * @brief hook the sensor items to their dbus services
- * @param devfd - file descriptor of ADC device sysfs directory
+ * @param dev - ADC device the sensor is connected to
  * @param pin - ADC pin number
- * @param scale - ADC scale in volts / unit
  * @param type - type of sensor
+ * @param cfg - ADC scale in volts / unit and sample / publish periods
  * @return Pointer to sensor struct
  */
-AnalogSensor *sensorCreate(int devfd, int pin, float scale, SensorType type,
-						   char const *drv)
+AnalogSensor *sensorCreate(AdcDevice *dev, int pin, SensorType type,
+						   const SensorConfig *cfg)
 {
 	AnalogSensor *sensor;
-	static un8 instance = 20;
+	AdcChannel *chan;
+	static int instance = 20;
+	un32 period;
+	int n;
+
+	if (table.count == table.size && !sensorTableGrow())
+		return NULL;
 
-	if (sensorCount == MAX_SENSORS)
+	chan = adcDeviceAddChannel(dev, pin);
+	if (!chan)
 		return NULL;
 
 	if (type == SENSOR_TYPE_TANK)
@@ -399,11 +610,38 @@ AnalogSensor *sensorCreate(int devfd, int pin, float scale, SensorType type,
 	if (!sensor)
 		return NULL;
 
-	sensors[sensorCount++] = sensor;
-
-	sensor->interface.devfd = devfd;
-	sensor->interface.adcPin = pin;
-	sensor->interface.adcScale = scale;
+	n = table.count++;
+	sensor->index = n;
+	table.sensor[n] = sensor;
+
+	table.channel[n] = chan;
+	table.value[n] = 0;
+	table.update[n] = 0;
+	table.scale[n] = cfg->scale;
+	table.sampleRaw[n] = 0;
+	table.sample[n] = 0;
+	table.filterResets[n] = 0;
+	table.filterTime[n] = 0;
+#ifdef ADC_FIXED_POINT
+	table.valueQ[n] = 0;
+	table.scaleQ[n] = cfg->scale * 4294967296.0;
+	table.sampleRawQ[n] = 0;
+	table.sampleQ[n] = 0;
+#endif
+	table.valid[n] = veFalse;
+	table.pending[n] = veFalse;
+	table.filterChain[n] = filterChainCreate(&cfg->filter);
+
+	/* oversampling reads the input that many times per sample period */
+	period = cfg->samplePeriod ? cfg->samplePeriod : SENSOR_SAMPLE_PERIOD;
+	if (cfg->filter.oversample > 1)
+		period = (period + cfg->filter.oversample - 1) / cfg->filter.oversample;
+	table.samplePeriod[n] = period;
+	table.nextSample[n] = 0;
+	if (!dev->samplePeriod || period < dev->samplePeriod)
+		dev->samplePeriod = period;
+
+	sensor->publishPeriod = cfg->publishPeriod ? cfg->publishPeriod : SENSOR_PUBLISH_PERIOD;
 	sensor->sensorType = type;
 	sensor->instance = instance++;
 	sensor->root = veItemAlloc(NULL, "");
@@ -413,114 +651,295 @@ AnalogSensor *sensorCreate(int devfd, int pin, float scale, SensorType type,
 	else if (sensor->sensorType == SENSOR_TYPE_TEMP)
 		temperatureInit(sensor);
 
-	createItems(sensor, drv);
+	createFunctionItem(sensor);
 
 	return sensor;
 }
 
 /**
- * @brief process the tank level sensor adc data
- * @param sensor - pointer to the sensor struct
- * @return Boolean status veTrue - success, veFalse - fail
+ * @brief sets the shape of a tank from a strapping table
+ * @param sensor - the tank sensor
+ * @param file - CSV file of height and volume rows, see strappingLoad()
+ * @return veFalse if the table cannot be used
  */
-static void updateTank(AnalogSensor *sensor)
+veBool sensorSetStrapping(AnalogSensor *sensor, const char *file)
 {
-	float level, capacity;
-	SensorStatus status = SENSOR_STATUS_UNKNOWN;
-	VeVariant v;
 	struct TankSensor *tank = (struct TankSensor *) sensor;
-	float tankEmptyR, tankFullR, tankR, tankRRaw, tankMinR;
-	float vMeas = sensor->interface.adcSample;
-	float vMeasRaw = sensor->interface.adcSampleRaw;
+	float node[TANK_SHAPE_LUT_SIZE + 1];
+
+	if (sensor->sensorType != SENSOR_TYPE_TANK)
+		return veFalse;
+
+	if (!strappingLoad(file, node, TANK_SHAPE_LUT_SIZE + 1))
+		return veFalse;
+
+	tankShapeSetNodes(tank, node);
+	tank->strapped = veTrue;
+
+	return veTrue;
+}
+
+/**
+ * @brief sets the probe model of a temperature sensor
+ * @param sensor - the temperature sensor
+ * @param name - lm335, or a model known to tempModelGet()
+ * @param supply - V, the bias supply of a resistive probe
+ * @param pullUp - ohm, from the bias supply to the probe
+ * @return veFalse for an unknown model
+ *
+ * The probe is loaded by the input divider, a resistive probe is further
+ * biased as given, which depends on the hardware.
+ */
+veBool sensorSetTemperatureModel(AnalogSensor *sensor, const char *name,
+								 float supply, float pullUp)
+{
+	struct TemperatureSensor *temperature = (struct TemperatureSensor *) sensor;
+	TempFrontEnd fe = { supply, pullUp, TEMP_SENS_R1 + TEMP_SENS_R2 };
+
+	if (sensor->sensorType != SENSOR_TYPE_TEMP)
+		return veFalse;
+
+	if (!strcmp(name, "lm335")) {
+		temperature->model = NULL;
+		return veTrue;
+	}
+
+	temperature->model = tempModelGet(name, &fe);
+
+	return temperature->model != NULL;
+}
+
+/**
+ * @brief sets the deadband of an item, for all sensors
+ * @param item - name of the item, e.g. "Level"
+ * @param abs - minimum absolute change
+ * @param rel - minimum change relative to the last value sent
+ * @return veFalse for an unknown item
+ */
+veBool sensorSetDeadband(const char *item, float abs, float rel)
+{
+	int i;
+
+	for (i = 0; i < PUBLISH_COUNT; i++) {
+		if (!strcmp(publishNames[i], item)) {
+			deadbands[i].abs = abs;
+			deadbands[i].rel = rel;
+			return veTrue;
+		}
+	}
+
+	return veFalse;
+}
+
+/**
+ * @brief sets the maximum time an unchanged value is not sent
+ * @param heartbeat - in ms, 0 to only send changes
+ */
+void sensorSetHeartbeat(un32 heartbeat)
+{
 	int i;
 
-	tankR = vMeas / (TANK_SENS_VREF - vMeas) * TANK_SENS_R1;
-	tankRRaw = vMeasRaw / (TANK_SENS_VREF - vMeasRaw) * TANK_SENS_R1;
+	for (i = 0; i < PUBLISH_COUNT; i++)
+		deadbands[i].heartbeat = heartbeat;
+}
+
+/*
+ * Every item set ends up as a signal for all clients,
+ * so only send a value when it moved out of the deadband around the
+ * last value sent, or when it wasn't sent for a heartbeat.
+ *
+ * The signals are sent by the velib item exporter, one per item set as
+ * far as this tree can tell; velib is a submodule and it is unverified
+ * here whether it can send the changes of a pass as one ItemsChanged
+ * signal. These helpers are the single place the sets would be collected.
+ */
+static veBool publishDue(PublishState *st, PublishKind kind, float value, uint64_t now)
+{
+	const Deadband *db = &deadbands[kind];
+	float delta;
+
+	if (!st->valid)
+		return veTrue;
+
+	if (db->heartbeat && now - st->sent >= db->heartbeat)
+		return veTrue;
+
+	delta = fabsf(value - st->value);
+
+	return delta > db->abs && delta > db->rel * fabsf(st->value);
+}
+
+static void publishSent(PublishState *st, float value, uint64_t now)
+{
+	st->value = value;
+	st->valid = veTrue;
+	st->sent = now;
+}
+
+static void publishUn32(struct VeItem *item, PublishState *st, PublishKind kind,
+						un32 value, uint64_t now)
+{
+	VeVariant v;
+
+	if (!publishDue(st, kind, value, now))
+		return;
+
+	veItemOwnerSet(item, veVariantUn32(&v, value));
+	tickStats.itemChanges++;
+	publishSent(st, value, now);
+}
 
-	veItemOwnerSet(sensor->rawValueItem, veVariantFloat(&v, tankRRaw));
+static void publishSn32(struct VeItem *item, PublishState *st, PublishKind kind,
+						sn32 value, uint64_t now)
+{
+	VeVariant v;
+
+	if (!publishDue(st, kind, value, now))
+		return;
+
+	veItemOwnerSet(item, veVariantSn32(&v, value));
+	tickStats.itemChanges++;
+	publishSent(st, value, now);
+}
+
+static void publishFloat(struct VeItem *item, PublishState *st, PublishKind kind,
+						 float value, uint64_t now)
+{
+	VeVariant v;
+
+	if (!publishDue(st, kind, value, now))
+		return;
+
+	veItemOwnerSet(item, veVariantFloat(&v, value));
+	tickStats.itemChanges++;
+	publishSent(st, value, now);
+}
+
+static void publishInvalidate(struct VeItem *item, PublishState *st)
+{
+	if (!st->valid)
+		return;
+
+	veItemInvalidate(item);
+	st->valid = veFalse;
+	tickStats.itemChanges++;
+}
+
+/*
+ * The divider formula and the checks on the resistance only depend on
+ * the settings, so they are done once, as thresholds on the voltage, and
+ * again when a setting changes. The divider is monotonic, so comparing
+ * voltages gives the same result as comparing resistances.
+ */
+static veBool tankConversionUpdate(struct TankSensor *tank)
+{
+	TankConversion *c = &tank->conv;
+	float tankEmptyR, tankFullR, tankMaxR, tankMinR;
+	VeVariant v;
 
 	if (!veVariantIsValid(veItemLocalValue(tank->emptyRItem, &v)))
-		goto errorState;
+		return veFalse;
 	tankEmptyR = v.value.SN32;
 
 	if (!veVariantIsValid(veItemLocalValue(tank->fullRItem, &v)))
-		goto errorState;
+		return veFalse;
 	tankFullR = v.value.SN32;
 
 	if (!veVariantIsValid(veItemLocalValue(tank->capacityItem, &v)))
-		goto errorState;
-	capacity = v.value.Float;
+		return veFalse;
+	c->capacity = v.value.Float;
 
 	/* prevent division by zero, configuration issue */
 	if (tankFullR == tankEmptyR)
-		goto errorState;
+		return veFalse;
 
 	/* If the resistance is higher then the max supported; assume not connected */
-	if (tankR > fmax(tankEmptyR, tankFullR) * 1.05) {
+	tankMaxR = fmax(tankEmptyR, tankFullR) * 1.05;
+	c->vOpen = TANK_SENS_VREF * tankMaxR / (tankMaxR + TANK_SENS_R1);
+
+	/* Detect short, but only if not allow by the spec and a bit significant */
+	tankMinR = fmin(tankEmptyR, tankFullR);
+	if (tankMinR > 20) {
+		tankMinR *= 0.9;
+		c->vShort = TANK_SENS_VREF * tankMinR / (tankMinR + TANK_SENS_R1);
+	} else {
+		c->vShort = 0;
+	}
+
+	c->gain = TANK_SENS_R1 / (tankFullR - tankEmptyR);
+	c->offset = tankEmptyR / (tankFullR - tankEmptyR);
+	c->valid = veTrue;
+
+	return veTrue;
+}
+
+/**
+ * @brief process the tank level sensor adc data
+ * @param sensor - pointer to the sensor struct
+ * @param now - monotonic time in ms
+ */
+static void updateTank(AnalogSensor *sensor, uint64_t now)
+{
+	float level;
+	SensorStatus status = SENSOR_STATUS_UNKNOWN;
+	struct TankSensor *tank = (struct TankSensor *) sensor;
+	TankConversion *c = &tank->conv;
+	float vMeas = table.sample[sensor->index];
+	float vMeasRaw = table.sampleRaw[sensor->index];
+
+	publishFloat(sensor->rawValueItem, &sensor->rawValuePub, PUBLISH_RESISTANCE,
+				 vMeasRaw / (TANK_SENS_VREF - vMeasRaw) * TANK_SENS_R1, now);
+
+	if (!c->valid && !tankConversionUpdate(tank))
+		goto errorState;
+
+	if (vMeas > c->vOpen) {
 		status = SENSOR_STATUS_NOT_CONNECTED;
 		goto errorState;
 	}
 
-	/* Detect short, but only if not allow by the spec and a bit significant */
-	tankMinR = fmin(tankEmptyR, tankFullR);
-	if (tankMinR > 20 && tankR < 0.9 * tankMinR) {
+	if (vMeas < c->vShort) {
 		status = SENSOR_STATUS_SHORT;
 		goto errorState;
 	}
 
 	status = SENSOR_STATUS_OK;
-	level = (tankR - tankEmptyR) / (tankFullR - tankEmptyR);
+	level = vMeas * c->gain / (TANK_SENS_VREF - vMeas) - c->offset;
 	if (level < 0)
 		level = 0;
 	if (level > 1)
 		level = 1;
 
-	for (i = 1; i < tank->shapeMapLen; i++) {
-		if (tank->shapeMap[i][0] >= level) {
-			float s0 = tank->shapeMap[i - 1][0];
-			float s1 = tank->shapeMap[i    ][0];
-			float l0 = tank->shapeMap[i - 1][1];
-			float l1 = tank->shapeMap[i    ][1];
-			level = l0 + (level - s0) / (s1 - s0) * (l1 - l0);
-			break;
-		}
-	}
-
-	VeVariant oldRemaining;
-	float newRemaing = level * capacity;
-	float minRemainingChange = capacity / 5000.0f;
-
-	veItemLocalValue(tank->remaingItem, &oldRemaining);
-	if (veVariantIsValid(&oldRemaining) && fabsf(oldRemaining.value.Float - newRemaing) < minRemainingChange)
-		return;
+	if (tank->hasShape)
+		level = tankShapeLevel(tank, level);
 
-	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
-	veItemOwnerSet(tank->levelItem, veVariantUn32(&v, 100 * level));
-	veItemOwnerSet(tank->remaingItem, veVariantFloat(&v, level * capacity));
+	publishUn32(sensor->statusItem, &sensor->statusPub, PUBLISH_STATUS, status, now);
+	publishUn32(tank->levelItem, &tank->levelPub, PUBLISH_LEVEL, 100 * level, now);
+	publishFloat(tank->remaingItem, &tank->remainingPub, PUBLISH_REMAINING, level * c->capacity, now);
 
 	return;
 
 errorState:
-	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
-	veItemInvalidate(tank->levelItem);
-	veItemInvalidate(tank->remaingItem);
+	publishUn32(sensor->statusItem, &sensor->statusPub, PUBLISH_STATUS, status, now);
+	publishInvalidate(tank->levelItem, &tank->levelPub);
+	publishInvalidate(tank->remaingItem, &tank->remainingPub);
 }
 
 /**
  * @brief process the temperature sensor adc data
  * @param sensor - pointer to the sensor struct
- * @return Boolean status veTrue-success, veFalse-fail
+ * @param now - monotonic time in ms
  */
-static void updateTemperature(AnalogSensor *sensor)
+static void updateTemperature(AnalogSensor *sensor, uint64_t now)
 {
 	float tempC, offset, scale;
 	SensorStatus status = SENSOR_STATUS_UNKNOWN;
-	float adcSample = sensor->interface.adcSample;
-	float adcSampleRaw = sensor->interface.adcSampleRaw;
+	float adcSample = table.sample[sensor->index];
+	float adcSampleRaw = table.sampleRaw[sensor->index];
 	struct TemperatureSensor *temperature = (struct TemperatureSensor *) sensor;
 	VeVariant v;
 
-	// calculate the output of the LM335 temperature sensor from the adc pin sample
+	// calculate the voltage across the temperature sensor from the adc pin sample
 	float vSense = adcSample * TEMP_SENS_V_RATIO;
 	float vSenseRaw = adcSampleRaw * TEMP_SENS_V_RATIO;
 
@@ -532,14 +951,11 @@ static void updateTemperature(AnalogSensor *sensor)
 		goto updateState;
 	scale = v.value.Float;
 
-	if (adcSample > TEMP_SENS_MIN_ADCIN && adcSample < TEMP_SENS_MAX_ADCIN) {
+	if (temperature->model) {
+		status = tempModelConvert(temperature->model, vSense, &tempC);
+	} else if (adcSample > TEMP_SENS_MIN_ADCIN && adcSample < TEMP_SENS_MAX_ADCIN) {
 		// convert from Kelvin to Celsius
 		tempC = 100 * vSense - 273;
-		// Signal scale correction
-		tempC *= scale;
-		// Signal offset correction
-		tempC += offset;
-
 		status = SENSOR_STATUS_OK;
 	} else if (adcSample > TEMP_SENS_MAX_ADCIN) {
 		// open circuit error
@@ -555,15 +971,29 @@ static void updateTemperature(AnalogSensor *sensor)
 		status = SENSOR_STATUS_UNKNOWN;
 	}
 
+	if (status == SENSOR_STATUS_OK) {
+		// Signal scale correction
+		tempC *= scale;
+		// Signal offset correction
+		tempC += offset;
+	}
+
 updateState:
-	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
+	publishUn32(sensor->statusItem, &sensor->statusPub, PUBLISH_STATUS, status, now);
 	if (status == SENSOR_STATUS_OK)
-		veItemOwnerSet(temperature->temperatureItem, veVariantSn32(&v, tempC));
+		publishSn32(temperature->temperatureItem, &temperature->temperaturePub, PUBLISH_TEMPERATURE, tempC, now);
 	else
-		veItemInvalidate(temperature->temperatureItem);
-	veItemOwnerSet(sensor->rawValueItem, veVariantFloat(&v, vSenseRaw));
+		publishInvalidate(temperature->temperatureItem, &temperature->temperaturePub);
+	publishFloat(sensor->rawValueItem, &sensor->rawValuePub, PUBLISH_VOLTAGE, vSenseRaw, now);
 }
 
+/*
+ * Each service needs a connection of its own. Signals carry the unique
+ * name of the connection, not the service name, and all services
+ * export the same paths, so a client watching the /Level of one tank
+ * would also see the /Level of every other tank on a shared connection.
+ * Connections are only made for inputs which are in use.
+ */
 static void sensorDbusConnect(AnalogSensor *sensor)
 {
 	sensor->dbus = veDbusConnectString(veDbusGetDefaultConnectString());
@@ -578,71 +1008,548 @@ static void sensorDbusConnect(AnalogSensor *sensor)
 	logI(sensor->interface.dbus.service, "connected to dbus");
 }
 
-void sensorTick(void)
+/* only a counter that moved is sent, the others would be signals for nothing */
+static void publishDebug(DebugItem *debug, un32 value)
+{
+	VeVariant v;
+
+	if (debug->valid && debug->value == value)
+		return;
+
+	veItemOwnerSet(debug->item, veVariantUn32(&v, value));
+	tickStats.itemChanges++;
+	debug->value = value;
+	debug->valid = veTrue;
+}
+
+/*
+ * The channel counters and the overruns and lost samples may be counted
+ * on a worker or the acquisition thread, they are read with STAT_GET().
+ * The others are only touched by the main loop.
+ */
+static void sensorDebugUpdate(AnalogSensor *sensor, uint64_t now)
 {
+	SensorPerf *perf = &sensor->perf;
+	AdcChannel *chan = table.channel[sensor->index];
 	int i;
+
+	if (now < perf->nextPublish)
+		return;
+	perf->nextPublish = now + SENSOR_DEBUG_PERIOD;
+
+	for (i = 0; i < ADC_LATENCY_BUCKETS; i++)
+		publishDebug(&perf->readLatency[i], STAT_GET(chan->stats.latency[i]));
+	publishDebug(&perf->reads, STAT_GET(chan->stats.reads));
+	publishDebug(&perf->readErrors, STAT_GET(chan->stats.errors));
+	publishDebug(&perf->reopens, STAT_GET(chan->stats.reopens));
+	publishDebug(&perf->syscalls, STAT_GET(chan->stats.syscalls));
+	publishDebug(&perf->filterResets, table.filterResets[sensor->index]);
+	publishDebug(&perf->overrunsItem, STAT_GET(perf->overruns));
+	publishDebug(&perf->lostItem, STAT_GET(perf->lost));
+	publishDebug(&perf->messagesItem, perf->messages);
+	publishDebug(&perf->tickTime, tickStats.avgUs);
+	publishDebug(&perf->tickTimeMax, tickStats.maxUs);
+}
+
+static void sensorPublish(AnalogSensor *sensor, uint64_t now)
+{
+	un32 itemChanges = tickStats.itemChanges;
 	VeVariant v;
-	static int secCounter;
-	veBool isSec = veFalse;
 
-	if (++secCounter == 10) {
-		isSec = veTrue;
-		secCounter = 0;
+	if (!veVariantIsValid(veItemLocalValue(sensor->function, &v)))
+		return;
+
+	switch (v.value.SN32) {
+	case SENSOR_FUNCTION_DEFAULT:
+		if (!sensor->itemsCreated)
+			createItems(sensor, table.channel[sensor->index]->dev->name);
+
+		if (!sensor->interface.dbus.connected) {
+			sensorDbusConnect(sensor);
+			sensor->interface.dbus.connected = veTrue;
+		}
+
+#ifdef ADC_FIXED_POINT
+		/* the samples are only converted to float to be published */
+		table.sampleRaw[sensor->index] = (float) table.sampleRawQ[sensor->index] / Q24_ONE;
+		table.sample[sensor->index] = (float) table.sampleQ[sensor->index] / Q24_ONE;
+#endif
+
+		switch (sensor->sensorType) {
+		case SENSOR_TYPE_TANK:
+			updateTank(sensor, now);
+			break;
+
+		case SENSOR_TYPE_TEMP:
+			updateTemperature(sensor, now);
+			break;
+		}
+
+		sensorDebugUpdate(sensor, now);
+		sensor->perf.messages += tickStats.itemChanges - itemChanges;
+		break;
+
+	case SENSOR_FUNCTION_NONE:
+	default:
+		if (sensor->interface.dbus.connected) {
+			veDbusDisconnect(sensor->dbus);
+			sensor->interface.dbus.connected = veFalse;
+		}
+		break;
+	}
+}
+
+/*
+ * Advance a deadline by a period, without running behind. After a stall
+ * it skips whole periods, so the deadlines spread by sensorStart() keep
+ * their phase instead of all landing on the same tick.
+ */
+static uint64_t nextDeadline(uint64_t deadline, un32 period, uint64_t now)
+{
+	deadline += period;
+	if (deadline <= now)
+		deadline += ((now - deadline) / period + 1) * period;
+
+	return deadline;
+}
+
+/* the ring and its eventfd are only touched by the main loop from here on */
+static veBool sensorAcquireStart(void)
+{
+	AdcDevice *dev;
+
+	if (!table.count)
+		return veFalse;
+
+	/* the thread reads inline, it can't wait for a worker */
+	for (dev = adcDeviceList(); dev; dev = dev->next) {
+		if (dev->threaded)
+			return veFalse;
+	}
+
+	if (!sampleRingInit(&acquireRing, table.count * SENSOR_RING_CYCLES))
+		return veFalse;
+
+	acquireFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (acquireFd < 0)
+		return veFalse;
+
+	if (!acquireStart(acquirePriority)) {
+		close(acquireFd);
+		acquireFd = -1;
+		return veFalse;
 	}
 
-	/* Read the ADC values */
-	for (i = 0; i < sensorCount; i++) {
-		AnalogSensor *sensor = sensors[i];
-		un32 val;
+	return veTrue;
+}
+
+/**
+ * @brief sets the first deadlines of all sensors
+ * @param now - monotonic time in ms
+ *
+ * The publish deadlines are spread evenly over the publish period, so
+ * the services don't all send their updates in the same tick.
+ */
+void sensorStart(uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < table.count; i++) {
+		AnalogSensor *sensor = table.sensor[i];
 
-		sensor->valid = adcRead(&val, sensor);
-		if (sensor->valid)
-			sensor->interface.adcSampleRaw = val * sensor->interface.adcScale;
+		table.nextSample[i] = now;
+		sensor->nextPublish = now + (uint64_t) sensor->publishPeriod * i / table.count;
 	}
 
-	/* Handle ADC values */
-	for (i = 0; i < sensorCount; i++) {
-		AnalogSensor *sensor = sensors[i];
-		FilerIirLpf *filter = &sensor->interface.sigCond.filterIirLpf;
+	if (acquirePriority >= 0 && !sensorAcquireStart())
+		logE("sensors", "sampling from the main loop");
+}
+
+/* mark the inputs to read per device, returns the next sample deadline */
+static uint64_t sensorCollect(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < table.count; i++) {
+		AdcChannel *chan = table.channel[i];
 
-		if (!sensor->valid)
+		if (chan->dev->wakeOnData)
 			continue;
 
-		/* filter the input ADC sample, high rate */
-		sensor->interface.adcSample = adcFilter(sensor->interface.adcSampleRaw, filter);
+		if (table.nextSample[i] <= now) {
+			if (now - table.nextSample[i] >= table.samplePeriod[i])
+				STAT_INC(table.sensor[i]->perf.overruns);
+			table.nextSample[i] = nextDeadline(table.nextSample[i], table.samplePeriod[i], now);
+
+			/*
+			 * The previous cycle still hasn't finished, this sample is
+			 * lost. The filter still holds the last good one.
+			 */
+			if (adcDeviceBusy(chan->dev)) {
+				STAT_INC(table.sensor[i]->perf.lost);
+			} else {
+				table.pending[i] = veTrue;
+				chan->due = veTrue;
+				chan->dev->requested = veTrue;
+			}
+		}
+
+		if (table.nextSample[i] < next)
+			next = table.nextSample[i];
+	}
+
+	return next;
+}
+
+/**
+ * @brief samples the sensors which are due, on the acquisition thread
+ * @param now - monotonic time in ms
+ * @return the time in ms at which the next sample is due
+ *
+ * The devices are read inline and the samples queued, with the time of
+ * the read, for sensorAcquiredData() on the main loop. The sample
+ * deadlines and pending flags of the polled inputs, and the channels
+ * of their devices, belong to this thread while it runs; the sensors
+ * on a device which is read on data arrival stay with the main loop.
+ * A sample which doesn't fit in the ring is counted as lost.
+ */
+uint64_t sensorAcquire(uint64_t now)
+{
+	uint64_t next = sensorCollect(now);
+	veBool queued = veFalse;
+	uint64_t one = 1;
+	AdcDevice *dev;
+	int i;
 
-		/* dbus update part can be at a lower rate */
-		if (!isSec)
+	for (dev = adcDeviceList(); dev; dev = dev->next) {
+		if (!dev->requested)
 			continue;
 
-		if (!veVariantIsValid(veItemLocalValue(sensor->function, &v)))
+		dev->requested = veFalse;
+		adcDeviceRequest(dev);
+	}
+
+	for (i = 0; i < table.count; i++) {
+		AdcChannel *chan = table.channel[i];
+		AcquiredSample s;
+
+		if (chan->dev->wakeOnData || !table.pending[i])
 			continue;
 
-		switch (v.value.SN32) {
-		case SENSOR_FUNCTION_DEFAULT:
-			if (!sensor->interface.dbus.connected) {
-				sensorDbusConnect(sensor);
-				sensor->interface.dbus.connected = veTrue;
-			}
+		table.pending[i] = veFalse;
+		s.index = i;
+		s.ok = chan->ok;
+		s.value = chan->value;
+		s.time = chan->time;
+		if (sampleRingPush(&acquireRing, &s))
+			queued = veTrue;
+		else
+			STAT_INC(table.sensor[i]->perf.lost);
+	}
 
-			switch (sensor->sensorType) {
-			case SENSOR_TYPE_TANK:
-				updateTank(sensor);
-				break;
+	if (queued && write(acquireFd, &one, sizeof(one)) != sizeof(one))
+		logE("sensors", "acquisition: %s", strerror(errno));
 
-			case SENSOR_TYPE_TEMP:
-				updateTemperature(sensor);
-				break;
-			}
-			break;
+	return next;
+}
 
-		case SENSOR_FUNCTION_NONE:
-		default:
-			if (sensor->interface.dbus.connected) {
-				veDbusDisconnect(sensor->dbus);
-				sensor->interface.dbus.connected = veFalse;
-			}
-			break;
+/**
+ * @brief samples and publishes the sensors which are due
+ * @param now - monotonic time in ms
+ * @return the time in ms at which the next sensor is due
+ *
+ * The due inputs are read in one cycle per device. Sensors on a device
+ * which is read on data arrival are only published here, see
+ * sensorDeviceReadable(). For threaded devices the samples are picked
+ * up when the cycle completes, see sensorDeviceData(). With the
+ * acquisition thread running, the sensors are only published here.
+ */
+uint64_t sensorTick(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t start = adcTimeNs();
+	AdcDevice *dev;
+	un32 ns;
+	int i;
+
+	if (acquireFd < 0) {
+		/* Collect the ADC inputs to read, per device */
+		next = sensorCollect(now);
+
+		/* Read the ADC values */
+		for (dev = adcDeviceList(); dev; dev = dev->next) {
+			if (!dev->requested)
+				continue;
+
+			dev->requested = veFalse;
+			adcDeviceRequest(dev);
+			if (!dev->threaded)
+				sensorDeviceData(dev);
+		}
+	}
+
+	/* dbus update part can be at a lower rate */
+	for (i = 0; i < table.count; i++) {
+		AnalogSensor *sensor = table.sensor[i];
+
+		if (sensor->nextPublish <= now) {
+			sensor->nextPublish = nextDeadline(sensor->nextPublish, sensor->publishPeriod, now);
+			if (table.valid[i])
+				sensorPublish(sensor, now);
 		}
+
+		if (sensor->nextPublish < next)
+			next = sensor->nextPublish;
+	}
+
+	ns = adcTimeNs() - start;
+	tickStats.ns += ns;
+	tickStats.count++;
+	if (ns > tickStats.maxNs)
+		tickStats.maxNs = ns;
+
+	/* the tick times are of all sensors, per debug period */
+	if (now >= tickStats.windowEnd) {
+		tickStats.avgUs = tickStats.ns / tickStats.count / 1000;
+		tickStats.maxUs = tickStats.maxNs / 1000;
+		tickStats.ns = 0;
+		tickStats.count = 0;
+		tickStats.maxNs = 0;
+		tickStats.windowEnd = now + SENSOR_DEBUG_PERIOD;
+	}
+
+	return next;
+}
+
+/*
+ * The low pass coefficient is computed for the time since the previous
+ * sample was filtered, so the cutoff frequency holds when samples come
+ * late or are skipped. It is only recomputed when the interval changes
+ * by more than 1/16, well above the jitter of the timers, so the expf()
+ * stays off the path of the samples that come on time. The cutoff is off
+ * by at most as much in between.
+ */
+static void sensorFilterInterval(int n, uint64_t time)
+{
+	uint64_t dt, diff;
+
+	if (table.filterTime[n] && time > table.filterTime[n]) {
+		dt = (time - table.filterTime[n]) / 1000;
+		if (dt > UINT32_MAX)
+			dt = UINT32_MAX;
+
+		diff = dt > table.filterDt[n] ? dt - table.filterDt[n] : table.filterDt[n] - dt;
+		if (diff * 16 > table.filterDt[n])
+			sensorFilterAlpha(n, dt);
+	}
+
+	table.filterTime[n] = time;
+}
+
+/*
+ * Takes a sample of lane n in, returns veTrue when it is to be filtered.
+ * A failed read invalidates the lane. A good one only validates it once
+ * the chain passes a sample on, until then the lane keeps its previous
+ * state, so a decimator that is still collecting doesn't publish 0 V.
+ */
+static veBool sensorSampleIn(int n, veBool ok, un32 value, uint64_t time)
+{
+	FilterChain *chain = table.filterChain[n];
+
+	if (!ok) {
+		table.valid[n] = veFalse;
+		return veFalse;
+	}
+
+#ifdef ADC_FIXED_POINT
+	/* integer, unless the lane has a chain, whose stages are float */
+	if (chain) {
+		float x = value;
+
+		if (!filterChainIn(chain, &x))
+			return veFalse;
+		table.valueQ[n] = x * Q16_ONE;
+	} else {
+		table.valueQ[n] = value << 16;
 	}
+#else
+	table.value[n] = value;
+	if (chain && !filterChainIn(chain, &table.value[n]))
+		return veFalse;
+#endif
+
+	sensorFilterInterval(n, time);
+	table.update[n] = 1;
+	table.valid[n] = veTrue;
+
+	return veTrue;
+}
+
+/* scale and filter the input ADC samples of the updated lanes in [lo, hi) */
+static void sensorFilterLanes(int lo, int hi)
+{
+#ifdef ADC_FIXED_POINT
+	AdcFilterBatchFixed batch;
+#else
+	AdcFilterBatch batch;
+#endif
+	int i;
+
+	if (lo >= hi)
+		return;
+
+#ifdef ADC_FIXED_POINT
+	batch.value = table.valueQ + lo;
+	batch.update = table.update + lo;
+	batch.scale = table.scaleQ + lo;
+	batch.FF = table.filterFFQ + lo;
+	batch.alpha = table.filterAlphaQ + lo;
+	batch.last = table.filterLastQ + lo;
+	batch.sampleRaw = table.sampleRawQ + lo;
+	batch.sample = table.sampleQ + lo;
+	batch.resets = table.filterResets + lo;
+	adcFilterBatchFixed(&batch, hi - lo);
+#else
+	batch.value = table.value + lo;
+	batch.update = table.update + lo;
+	batch.scale = table.scale + lo;
+	batch.FF = table.filterFF + lo;
+	batch.alpha = table.filterAlpha + lo;
+	batch.last = table.filterLast + lo;
+	batch.sampleRaw = table.sampleRaw + lo;
+	batch.sample = table.sample + lo;
+	batch.resets = table.filterResets + lo;
+	adcFilterBatch(&batch, hi - lo);
+#endif
+
+	for (i = lo; i < hi; i++) {
+		FilterChain *chain = table.filterChain[i];
+
+		if (!table.update[i] || !chain || chain->cfg.poles <= 1)
+			continue;
+
+#ifdef ADC_FIXED_POINT
+		/* the extra poles are float, like the other stages of the chain */
+		table.sampleQ[i] = Q24_ONE * filterChainOut(chain, (float) table.sampleQ[i] / Q24_ONE,
+													table.filterAlpha[i], table.filterFF[i]);
+#else
+		table.sample[i] = filterChainOut(chain, table.sample[i],
+										 table.filterAlpha[i], table.filterFF[i]);
+#endif
+	}
+}
+
+/**
+ * @brief takes the samples of a completed read cycle of a device
+ * @param dev - pointer to the device struct
+ */
+void sensorDeviceData(AdcDevice *dev)
+{
+	int lo = table.count;
+	int hi = 0;
+	int i;
+
+	for (i = 0; i < table.count; i++) {
+		AdcChannel *chan = table.channel[i];
+
+		table.update[i] = 0;
+		if (chan->dev != dev || !table.pending[i])
+			continue;
+
+		table.pending[i] = veFalse;
+		if (!sensorSampleIn(i, chan->ok, chan->value, chan->time))
+			continue;
+
+		if (i < lo)
+			lo = i;
+		hi = i + 1;
+	}
+
+	sensorFilterLanes(lo, hi);
+}
+
+/**
+ * @brief takes the samples queued by the acquisition thread
+ *
+ * Called when acquireFd becomes readable. A lane which has more than
+ * one sample queued, after the loop was held up, has its earlier
+ * samples filtered first.
+ */
+void sensorAcquiredData(void)
+{
+	AcquiredSample s;
+	int lo = table.count;
+	int hi = 0;
+	uint64_t n;
+
+	if (read(acquireFd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		logE("sensors", "acquisition: %s", strerror(errno));
+
+	memset(table.update, 0, table.count * sizeof(*table.update));
+
+	while (sampleRingPop(&acquireRing, &s)) {
+		if (table.update[s.index]) {
+			sensorFilterLanes(lo, hi);
+			memset(table.update + lo, 0, (hi - lo) * sizeof(*table.update));
+			lo = table.count;
+			hi = 0;
+		}
+
+		if (!sensorSampleIn(s.index, s.ok, s.value, s.time))
+			continue;
+
+		if (s.index < lo)
+			lo = s.index;
+		if (s.index >= hi)
+			hi = s.index + 1;
+	}
+
+	sensorFilterLanes(lo, hi);
+}
+
+/**
+ * @brief samples the polled sensors on a thread of their own
+ * @param priority - SCHED_FIFO priority, 0 for the normal scheduler
+ *
+ * The thread is started by sensorStart(), so the sampling doesn't wait
+ * for D-Bus traffic on the main loop. Must be set before the devices
+ * are started, they are then read by this thread instead of workers.
+ */
+void sensorSetRealtime(int priority)
+{
+	acquirePriority = priority;
+}
+
+/**
+ * @brief the eventfd signalled when the acquisition thread queued samples
+ * @return the file descriptor, -1 when the thread isn't running
+ */
+int sensorAcquireFd(void)
+{
+	return acquireFd;
+}
+
+/**
+ * @brief samples the sensors of a device whose buffer became readable
+ * @param dev - pointer to the device struct
+ * @param now - monotonic time in ms
+ *
+ * The sample period of these sensors is set by the trigger rate and
+ * watermark, the filters follow the time between the reads.
+ */
+void sensorDeviceReadable(AdcDevice *dev, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < table.count; i++) {
+		if (table.channel[i]->dev != dev)
+			continue;
+
+		table.pending[i] = veTrue;
+		table.channel[i]->due = veTrue;
+	}
+
+	adcDeviceRequest(dev);
+	sensorDeviceData(dev);
 }
@@ -0,0 +1,244 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+#define STRAPPING_MAX_ROWS	10000
+
+typedef struct {
+	int rows;
+	int size;
+	double *height;
+	double *volume;
+} StrappingTable;
+
+static veBool strappingAddRow(StrappingTable *t, double height, double volume)
+{
+	if (t->rows == t->size) {
+		int size = t->size ? 2 * t->size : 64;
+		double *h = realloc(t->height, size * sizeof(*h));
+		double *v;
+
+		if (!h)
+			return veFalse;
+		t->height = h;
+
+		v = realloc(t->volume, size * sizeof(*v));
+		if (!v)
+			return veFalse;
+		t->volume = v;
+
+		t->size = size;
+	}
+
+	t->height[t->rows] = height;
+	t->volume[t->rows] = volume;
+	t->rows++;
+
+	return veTrue;
+}
+
+/*
+ * A row is a height and a volume, separated by a comma, semicolon or
+ * white space. A line that isn't a row is only allowed before the first
+ * row, as the column header.
+ */
+static veBool strappingRead(StrappingTable *t, const char *file)
+{
+	char buf[128];
+	int line = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		logE("strapping", "cannot open %s", file);
+		return veFalse;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		double height, volume;
+		char *p, *end;
+
+		line++;
+
+		if (!strchr(buf, '\n') && !feof(f)) {
+			logE("strapping", "%s:%d: line too long", file, line);
+			goto error;
+		}
+
+		p = strchr(buf, '#');
+		if (p)
+			*p = 0;
+
+		p = buf + strspn(buf, " \t\r\n");
+		if (!*p)
+			continue;
+
+		height = strtod(p, &end);
+		if (end == p)
+			goto header;
+		p = end + strspn(end, " \t,;");
+
+		volume = strtod(p, &end);
+		if (end == p)
+			goto header;
+		if (end[strspn(end, " \t,;\r\n")]) {
+			logE("strapping", "%s:%d: trailing junk", file, line);
+			goto error;
+		}
+
+		if (!isfinite(height) || !isfinite(volume)) {
+			logE("strapping", "%s:%d: invalid number", file, line);
+			goto error;
+		}
+
+		if (t->rows && height <= t->height[t->rows - 1]) {
+			logE("strapping", "%s:%d: height not increasing", file, line);
+			goto error;
+		}
+
+		if (t->rows && volume < t->volume[t->rows - 1]) {
+			logE("strapping", "%s:%d: volume decreasing", file, line);
+			goto error;
+		}
+
+		if (t->rows == STRAPPING_MAX_ROWS) {
+			logE("strapping", "%s: more than %d rows", file, STRAPPING_MAX_ROWS);
+			goto error;
+		}
+
+		if (!strappingAddRow(t, height, volume)) {
+			logE("strapping", "out of memory");
+			goto error;
+		}
+		continue;
+
+header:
+		if (t->rows) {
+			logE("strapping", "%s:%d: malformed row", file, line);
+			goto error;
+		}
+	}
+
+	fclose(f);
+
+	if (t->rows < 2 || t->volume[t->rows - 1] == t->volume[0]) {
+		logE("strapping", "%s: needs at least two rows of different volume", file);
+		return veFalse;
+	}
+
+	return veTrue;
+
+error:
+	fclose(f);
+	return veFalse;
+}
+
+/*
+ * Fritsch-Carlson tangents, which keep the cubic Hermite interpolant
+ * monotone, so the level never runs backwards between two rows.
+ */
+static void strappingTangents(const StrappingTable *t, double *m)
+{
+	int n = t->rows;
+	int k;
+
+	for (k = 0; k < n - 1; k++)
+		m[k] = (t->volume[k + 1] - t->volume[k]) / (t->height[k + 1] - t->height[k]);
+	m[n - 1] = m[n - 2];
+
+	/* m[k] holds the secant of segment k, average it with the previous */
+	for (k = n - 2; k > 0; k--) {
+		double d0 = m[k - 1];
+		double d1 = m[k];
+
+		m[k] = d0 == 0 || d1 == 0 ? 0 : (d0 + d1) / 2;
+	}
+
+	for (k = 0; k < n - 1; k++) {
+		double d = (t->volume[k + 1] - t->volume[k]) / (t->height[k + 1] - t->height[k]);
+		double a, b, s;
+
+		if (d == 0) {
+			m[k] = m[k + 1] = 0;
+			continue;
+		}
+
+		a = m[k] / d;
+		b = m[k + 1] / d;
+		s = a * a + b * b;
+		if (s > 9) {
+			s = 3 / sqrt(s);
+			m[k] = s * a * d;
+			m[k + 1] = s * b * d;
+		}
+	}
+}
+
+/**
+ * @brief loads a strapping table and samples it at uniform heights
+ * @param file - the table, rows of height and volume in any units
+ * @param node - receives the volume fraction at n heights evenly spread
+ *				 from the first to the last row
+ * @param n - number of nodes, at least 2
+ * @return veTrue on success, errors are logged
+ *
+ * The rows are joined by a monotone cubic interpolant, so a table of any
+ * length costs the same to look up.
+ */
+veBool strappingLoad(const char *file, float *node, int n)
+{
+	StrappingTable t = { 0 };
+	double *m = NULL;
+	double h0, hSpan, v0, vSpan;
+	veBool ok = veFalse;
+	int i, k = 0;
+
+	if (!strappingRead(&t, file))
+		goto out;
+
+	m = malloc(t.rows * sizeof(*m));
+	if (!m) {
+		logE("strapping", "out of memory");
+		goto out;
+	}
+	strappingTangents(&t, m);
+
+	h0 = t.height[0];
+	hSpan = t.height[t.rows - 1] - h0;
+	v0 = t.volume[0];
+	vSpan = t.volume[t.rows - 1] - v0;
+
+	for (i = 0; i < n; i++) {
+		double x = h0 + hSpan * i / (n - 1);
+		double h, s, s2, s3, v;
+
+		while (k < t.rows - 2 && t.height[k + 1] < x)
+			k++;
+
+		h = t.height[k + 1] - t.height[k];
+		s = (x - t.height[k]) / h;
+		s2 = s * s;
+		s3 = s2 * s;
+		v = (2 * s3 - 3 * s2 + 1) * t.volume[k] +
+			(s3 - 2 * s2 + s) * h * m[k] +
+			(-2 * s3 + 3 * s2) * t.volume[k + 1] +
+			(s3 - s2) * h * m[k + 1];
+
+		node[i] = (v - v0) / vSpan;
+	}
+
+	logI("strapping", "%s: %d rows", file, t.rows);
+	ok = veTrue;
+
+out:
+	free(m);
+	free(t.height);
+	free(t.volume);
+
+	return ok;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+/*
+ * Fill the shape lookup table from the tank level at the cell boundaries,
+ * node[i] being the level at a sensor level of i / TANK_SHAPE_LUT_SIZE.
+ */
+void tankShapeSetNodes(struct TankSensor *tank, float const *node)
+{
+	int i;
+
+	for (i = 0; i < TANK_SHAPE_LUT_SIZE; i++) {
+		tank->shapeLut[i][0] = node[i];
+		tank->shapeLut[i][1] = node[i + 1] - node[i];
+	}
+	tank->hasShape = veTrue;
+}
+
+/**
+ * @brief parses the Shape setting
+ * @param map - "sensor:level" percentages, comma separated, both increasing
+ * @param points - receives up to TANK_SHAPE_MAX_POINTS + 1 points, from 0,0 to 1,1
+ * @return the number of points, 0 when the setting is invalid
+ */
+int tankShapeParse(const char *map, float (*points)[2])
+{
+	int i = 1;
+
+	points[0][0] = 0;
+	points[0][1] = 0;
+
+	while (i < TANK_SHAPE_MAX_POINTS) {
+		unsigned int s, l;
+
+		if (sscanf(map, "%u:%u", &s, &l) < 2) {
+			logE("tank", "malformed shape spec");
+			return 0;
+		}
+
+		if (s < 1 || s > 99 || l < 1 || l > 99) {
+			logE("tank", "shape level out of range 1-99");
+			return 0;
+		}
+
+		if (s / 100.0f <= points[i - 1][0] ||
+			l / 100.0f <= points[i - 1][1]) {
+			logE("tank", "shape level non-increasing");
+			return 0;
+		}
+
+		points[i][0] = s / 100.0f;
+		points[i][1] = l / 100.0f;
+		i++;
+
+		map = strchr(map, ',');
+		if (!map)
+			break;
+
+		map++;
+	}
+
+	points[i][0] = 1;
+	points[i][1] = 1;
+
+	return i + 1;
+}
+
+/*
+ * Resample the shape points, increasing from 0,0 to 1,1, at the cell
+ * boundaries. The Shape setting has whole percentages, which fall on the
+ * boundaries as long as the table size is a multiple of 100, so every
+ * cell is within a single segment and the table is exact.
+ */
+void tankShapeCompile(struct TankSensor *tank, float const (*points)[2], int n)
+{
+	float node[TANK_SHAPE_LUT_SIZE + 1];
+	int i, j = 1;
+
+	for (i = 0; i <= TANK_SHAPE_LUT_SIZE; i++) {
+		float x = (float) i / TANK_SHAPE_LUT_SIZE;
+		float s0, s1, l0, l1;
+
+		while (j < n - 1 && points[j][0] < x)
+			j++;
+
+		s0 = points[j - 1][0];
+		s1 = points[j    ][0];
+		l0 = points[j - 1][1];
+		l1 = points[j    ][1];
+		node[i] = l0 + (x - s0) / (s1 - s0) * (l1 - l0);
+	}
+
+	tankShapeSetNodes(tank, node);
+}
+
+/**
+ * @brief the tank level at a sensor level, from the shape lookup table
+ * @param tank - pointer to the tank sensor
+ * @param level - sensor level, 0 to 1
+ * @return the tank level
+ */
+float tankShapeLevel(const struct TankSensor *tank, float level)
+{
+	float x = level * TANK_SHAPE_LUT_SIZE;
+	int i = x;
+
+	if (i >= TANK_SHAPE_LUT_SIZE)
+		i = TANK_SHAPE_LUT_SIZE - 1;
+
+	return tank->shapeLut[i][0] + (x - i) * tank->shapeLut[i][1];
+}
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <event2/event.h>
 
 #include <velib/platform/plt.h>
 #include <velib/types/ve_dbus_item.h>
@@ -12,8 +15,6 @@
 
 #include "sensors.h"
 
-#define SENSOR_TICKS	2 /* 100ms */
-
 #define CONFIG_FILE	"/etc/venus/dbus-adc.conf"
 
 #define VREF_MIN	1.0
@@ -22,7 +23,25 @@
 #define SCALE_MIN	1023
 #define SCALE_MAX	65535
 
+#define BUFFER_MAX	65536
+#define RATE_MAX	100000 /* Hz */
+
+#define PERIOD_MIN	10 /* ms */
+#define PERIOD_MAX	3600000
+
+#define DEADBAND_MAX	1e6
+
+#define HEARTBEAT_MAX	86400 /* s */
+
+#define PRIORITY_MAX	99 /* SCHED_FIFO */
+
+#define BIAS_R_MIN		10 /* ohm */
+#define BIAS_R_MAX		1e6
+#define BIAS_V_MIN		0.5
+#define BIAS_V_MAX		30.0
+
 static struct VeItem *localSettings;
+static struct event *sensorTimer;
 
 static void error(const char *file, int line, const char *fmt, ...)
 {
@@ -103,15 +122,40 @@ static int openDev(const char *dev, const char *file, int line)
 	return fd;
 }
 
+/* deadband ITEM ABS [REL] */
+static void loadDeadband(const char *item, char *p, const char *file, int line)
+{
+	char *abs, *rel;
+	float relValue = 0;
+
+	abs = token(p, &p);
+	if (!abs)
+		error(file, line, "missing value\n");
+
+	rel = token(p, &p);
+	if (rel)
+		relValue = getFloat(rel, 0, 1, file, line);
+
+	if (token(p, &p))
+		error(file, line, "trailing junk\n");
+
+	if (!sensorSetDeadband(item, getFloat(abs, 0, DEADBAND_MAX, file, line), relValue))
+		error(file, line, "unknown item '%s'\n", item);
+}
+
 static void loadConfig(const char *file)
 {
 	FILE *f;
 	char buf[128];
-	char drv[128];
-	int devfd = -1;
+	AdcDevice *dev = NULL;
+	SensorConfig cfg = { 0 };
 	float vref = 0;
 	unsigned scale = 0;
+	int realtime = 0; /* line of the directive */
+	float biasR = 0;
+	float biasV = 0;
 	int line = 0;
+	AnalogSensor *sensor;
 	int type;
 	int pin;
 
@@ -140,13 +184,55 @@ static void loadConfig(const char *file)
 		if (!arg)
 			error(file, line, "missing value\n");
 
+		if (!strcmp(cmd, "deadband")) {
+			loadDeadband(arg, p, file, line);
+			continue;
+		}
+
 		rest = token(p, &p);
-		if (rest)
+		if (token(p, &p) || (rest && strcmp(cmd, "tank") && strcmp(cmd, "temp") &&
+				strcmp(cmd, "bias")))
 			error(file, line, "trailing junk\n");
 
 		if (!strcmp(cmd, "device")) {
-			devfd = openDev(arg, file, line);
-			snprintf(drv, sizeof(drv), "%s", arg);
+			dev = adcDeviceCreate(arg, openDev(arg, file, line));
+			if (!dev)
+				error(file, line, "error adding device\n");
+			continue;
+		}
+
+		if (!strcmp(cmd, "replay")) {
+			dev = adcReplayCreate(arg);
+			if (!dev)
+				error(file, line, "bad replay trace '%s'\n", arg);
+			continue;
+		}
+
+		if (!strcmp(cmd, "buffer")) {
+			if (!dev)
+				error(file, line, "%s requires device\n", cmd);
+			dev->bufLength = getUint(arg, 0, BUFFER_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "watermark")) {
+			if (!dev)
+				error(file, line, "%s requires device\n", cmd);
+			dev->watermark = getUint(arg, 1, BUFFER_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "rate")) {
+			if (!dev)
+				error(file, line, "%s requires device\n", cmd);
+			dev->rate = getUint(arg, 1, RATE_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "trigger")) {
+			if (!dev)
+				error(file, line, "%s requires device\n", cmd);
+			snprintf(dev->trigger, sizeof(dev->trigger), "%s", arg);
 			continue;
 		}
 
@@ -160,6 +246,57 @@ static void loadConfig(const char *file)
 			continue;
 		}
 
+		if (!strcmp(cmd, "sample")) {
+			cfg.samplePeriod = getUint(arg, PERIOD_MIN, PERIOD_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "realtime")) {
+			sensorSetRealtime(getUint(arg, 0, PRIORITY_MAX, file, line));
+			realtime = line;
+			continue;
+		}
+
+		if (!strcmp(cmd, "bias")) {
+			if (!rest)
+				error(file, line, "missing value\n");
+			biasR = getFloat(arg, BIAS_R_MIN, BIAS_R_MAX, file, line);
+			biasV = getFloat(rest, BIAS_V_MIN, BIAS_V_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "publish")) {
+			cfg.publishPeriod = getUint(arg, PERIOD_MIN, PERIOD_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "heartbeat")) {
+			sensorSetHeartbeat(getUint(arg, 0, HEARTBEAT_MAX, file, line) * 1000);
+			continue;
+		}
+
+		if (!strcmp(cmd, "oversample")) {
+			cfg.filter.oversample = getUint(arg, 1, FILTER_MAX_OVERSAMPLE, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "median")) {
+			cfg.filter.median = getUint(arg, 1, FILTER_MAX_MEDIAN, file, line);
+			if (!(cfg.filter.median & 1))
+				error(file, line, "median length must be odd\n");
+			continue;
+		}
+
+		if (!strcmp(cmd, "average")) {
+			cfg.filter.average = getUint(arg, 1, FILTER_MAX_AVERAGE, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "poles")) {
+			cfg.filter.poles = getUint(arg, 1, FILTER_MAX_POLES, file, line);
+			continue;
+		}
+
 		if (!strcmp(cmd, "tank"))
 			type = SENSOR_TYPE_TANK;
 		else if (!strcmp(cmd, "temp"))
@@ -167,7 +304,7 @@ static void loadConfig(const char *file)
 		else
 			error(file, line, "unknown directive\n");
 
-		if (devfd < 0)
+		if (!dev)
 			error(file, line, "%s requires device\n", cmd);
 
 		if (!vref)
@@ -177,10 +314,31 @@ static void loadConfig(const char *file)
 			error(file, line, "%s requires scale\n", cmd);
 
 		pin = getUint(arg, 0, -1u, file, line);
+		cfg.scale = vref / scale;
 
-		if (!sensorCreate(devfd, pin, vref / scale, type, drv))
+		sensor = sensorCreate(dev, pin, type, &cfg);
+		if (!sensor)
 			error(file, line, "error adding sensor\n");
+
+		if (rest && type == SENSOR_TYPE_TANK && !sensorSetStrapping(sensor, rest))
+			error(file, line, "bad strapping table '%s'\n", rest);
+
+		/* a wrong bias gives plausible but wrong temperatures, don't guess it */
+		if (rest && type == SENSOR_TYPE_TEMP && strcmp(rest, "lm335") && !biasR)
+			error(file, line, "%s requires bias\n", rest);
+
+		if (rest && type == SENSOR_TYPE_TEMP &&
+				!sensorSetTemperatureModel(sensor, rest, biasV, biasR))
+			error(file, line, "bad temperature model '%s'\n", rest);
 	}
+
+	fclose(f);
+
+	/* the acquisition thread reads the devices itself, a hung adc would hold up all */
+	if (realtime && adcDevicesMayBlock() > 1)
+		error(file, realtime, "realtime reads at most one device from sysfs\n");
+
+	adcDevicesStart(!realtime);
 }
 
 static void connectToDbus(void)
@@ -208,11 +366,119 @@ struct VeItem *getLocalSettings(void)
 	return localSettings;
 }
 
+static uint64_t timeMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sensors are sampled and published from a single timer which is armed
+ * for the earliest deadline, so the loop sleeps when nothing is due.
+ */
+static void onSensorTimer(evutil_socket_t fd, short events, void *ctx)
+{
+	uint64_t now = timeMs();
+	uint64_t next = sensorTick(now);
+	struct timeval tv;
+
+	if (next == UINT64_MAX)
+		return;
+
+	/* a deadline already passed runs at once, the missed periods are skipped and counted as overruns */
+	next = next > now ? next - now : 0;
+	tv.tv_sec = next / 1000;
+	tv.tv_usec = next % 1000 * 1000;
+	evtimer_add(sensorTimer, &tv);
+}
+
+static void onBufferData(evutil_socket_t fd, short events, void *ctx)
+{
+	sensorDeviceReadable(ctx, timeMs());
+}
+
+static void onAcquiredData(evutil_socket_t fd, short events, void *ctx)
+{
+	sensorAcquiredData();
+}
+
+static void onReadCycleDone(evutil_socket_t fd, short events, void *ctx)
+{
+	adcDeviceDone(ctx);
+	sensorDeviceData(ctx);
+	adcDeviceRelease(ctx);
+}
+
+/*
+ * Buffers with a trigger of their own wake the loop when they have data,
+ * worker threads when they finished a read cycle and the acquisition
+ * thread when it queued samples.
+ */
+static void watchDevices(void)
+{
+	AdcDevice *dev;
+	struct event *ev;
+
+	if (sensorAcquireFd() >= 0) {
+		ev = event_new(pltGetLibEventBase(), sensorAcquireFd(), EV_READ | EV_PERSIST,
+					   onAcquiredData, NULL);
+		if (!ev || event_add(ev, NULL) < 0) {
+			logE("task", "cannot watch the acquisition thread");
+			pltExit(1);
+		}
+	}
+
+	for (dev = adcDeviceList(); dev; dev = dev->next) {
+		if (dev->wakeOnData)
+			ev = event_new(pltGetLibEventBase(), dev->bufFd, EV_READ | EV_PERSIST,
+						   onBufferData, dev);
+		else if (dev->threaded)
+			ev = event_new(pltGetLibEventBase(), dev->doneFd, EV_READ | EV_PERSIST,
+						   onReadCycleDone, dev);
+		else
+			continue;
+
+		if (!ev || event_add(ev, NULL) < 0) {
+			logE("task", "cannot watch %s", dev->name);
+			pltExit(1);
+		}
+	}
+}
+
+/*
+ * Only the Function setting of each input is registered here, the others
+ * when an input is first enabled. The AddSetting calls don't wait for
+ * their replies (CFG_DBUS_NON_BLOCKING), so the config phase only covers
+ * sending them; the sensors log when the last reply arrived. Log the
+ * phases to keep an eye on it.
+ */
 void taskInit(void)
 {
+	uint64_t start, dbusDone, configDone, end;
+
 	pltExitOnOom();
+	start = timeMs();
 	connectToDbus();
+	dbusDone = timeMs();
 	loadConfig(CONFIG_FILE);
+	configDone = timeMs();
+	sensorStart(timeMs());
+	watchDevices();
+
+	sensorTimer = evtimer_new(pltGetLibEventBase(), onSensorTimer, NULL);
+	if (!sensorTimer) {
+		logE("task", "evtimer_new failed");
+		pltExit(1);
+	}
+	onSensorTimer(-1, EV_TIMEOUT, NULL);
+	end = timeMs();
+
+	logI("task", "started in %u ms: dbus %u ms, config and settings sent %u ms, first tick %u ms",
+		 (unsigned) (end - start), (unsigned) (dbusDone - start),
+		 (unsigned) (configDone - dbusDone), (unsigned) (end - configDone));
 }
 
 void taskUpdate(void)
@@ -220,15 +486,13 @@ void taskUpdate(void)
 	// Not in use
 }
 
-/* 50 ms time update. */
+/*
+ * Not in use, sensors are driven by sensorTimer. velib still calls it
+ * every 50 ms, so the process keeps waking up at 20 Hz when idle; that
+ * timer is set up by velib, outside this tree.
+ */
 void taskTick(void)
 {
-	static un16 sensorTimer = SENSOR_TICKS;
-
-	if (--sensorTimer == 0) {
-		sensorTimer = SENSOR_TICKS;
-		sensorTick();
-	}
 }
 
 char const *pltProgramVersion(void)
@@ -0,0 +1,180 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+// Steinhart-Hart coefficients of a 10k NTC thermistor
+#define NTC_A		1.129148e-3
+#define NTC_B		2.34125e-4
+#define NTC_C		8.76741e-8
+
+// Callendar-Van Dusen coefficients of IEC 60751 platinum probes
+#define CVD_A		3.9083e-3
+#define CVD_B		-5.775e-7
+#define CVD_C		-4.183e-12 /* below 0 C only */
+
+#define KELVIN		273.15
+
+/* The resistance from the Steinhart-Hart equation, solved for R */
+static double ntcResistance(double tempC)
+{
+	double x = (NTC_A - 1 / (tempC + KELVIN)) / NTC_C;
+	double y = sqrt(pow(NTC_B / (3 * NTC_C), 3) + x * x / 4);
+
+	return exp(cbrt(y - x / 2) - cbrt(y + x / 2));
+}
+
+static double cvdResistance(double r0, double t)
+{
+	double r = 1 + CVD_A * t + CVD_B * t * t;
+
+	if (t < 0)
+		r += CVD_C * (t - 100) * t * t * t;
+
+	return r0 * r;
+}
+
+static double pt100Resistance(double tempC)
+{
+	return cvdResistance(100, tempC);
+}
+
+static double pt1000Resistance(double tempC)
+{
+	return cvdResistance(1000, tempC);
+}
+
+static const TempModel models[] = {
+	{ .name = "ntc", .resistance = ntcResistance, .minC = -40, .maxC = 125 },
+	{ .name = "pt100", .resistance = pt100Resistance, .minC = -50, .maxC = 200 },
+	{ .name = "pt1000", .resistance = pt1000Resistance, .minC = -50, .maxC = 200 },
+};
+
+/* the models built so far, one per front end they are used with */
+static TempModel *built;
+
+/* The voltage across a probe, pulled up and loaded by the front end */
+static double tempModelVolts(const TempModel *m, double tempC)
+{
+	const TempFrontEnd *fe = &m->fe;
+	double r = m->resistance(tempC);
+
+	r = r * fe->load / (r + fe->load);
+
+	return fe->supply * r / (r + fe->pullUp);
+}
+
+/*
+ * The equations are only evaluated here, for the voltages at the cell
+ * boundaries. They give the voltage for a temperature, so the
+ * temperature is found by bisection, the voltage is monotonic in it.
+ */
+static void tempModelBuild(TempModel *m)
+{
+	double vMin = tempModelVolts(m, m->minC);
+	double vMax = tempModelVolts(m, m->maxC);
+	float node[TEMP_MODEL_LUT_SIZE + 1];
+	int i, j;
+
+	m->vLo = fmin(vMin, vMax);
+	m->vHi = fmax(vMin, vMax);
+	m->cellsPerVolt = TEMP_MODEL_LUT_SIZE / (m->vHi - m->vLo);
+
+	for (i = 0; i <= TEMP_MODEL_LUT_SIZE; i++) {
+		double v = m->vLo + (m->vHi - m->vLo) * i / TEMP_MODEL_LUT_SIZE;
+		double lo = m->minC;
+		double hi = m->maxC;
+
+		for (j = 0; j < 40; j++) {
+			double mid = (lo + hi) / 2;
+
+			if ((tempModelVolts(m, mid) < v) == (vMin < vMax))
+				lo = mid;
+			else
+				hi = mid;
+		}
+		node[i] = (lo + hi) / 2;
+	}
+
+	for (i = 0; i < TEMP_MODEL_LUT_SIZE; i++) {
+		m->lut[i][0] = node[i];
+		m->lut[i][1] = node[i + 1] - node[i];
+	}
+}
+
+/**
+ * @brief looks up a temperature probe model
+ * @param name - e.g. "ntc", "pt1000"
+ * @param fe - the front end of the input
+ * @return the model, NULL if unknown or out of memory, which is logged
+ *
+ * The lookup table is built on first use and shared by all inputs using
+ * the model with the same front end.
+ */
+const TempModel *tempModelGet(const char *name, const TempFrontEnd *fe)
+{
+	const TempModel *proto = NULL;
+	TempModel *m;
+	unsigned i;
+
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		if (!strcmp(models[i].name, name))
+			proto = &models[i];
+
+	if (!proto) {
+		logE("tempmodel", "unknown model '%s'", name);
+		return NULL;
+	}
+
+	for (m = built; m; m = m->next)
+		if (m->name == proto->name && m->fe.supply == fe->supply &&
+				m->fe.pullUp == fe->pullUp && m->fe.load == fe->load)
+			return m;
+
+	m = malloc(sizeof(*m));
+	if (!m) {
+		logE("tempmodel", "out of memory");
+		return NULL;
+	}
+
+	*m = *proto;
+	m->fe = *fe;
+	tempModelBuild(m);
+
+	m->next = built;
+	built = m;
+
+	return m;
+}
+
+/**
+ * @brief converts the voltage across a probe to a temperature
+ * @param m - the probe model
+ * @param v - voltage across the probe
+ * @param tempC - receives the temperature in degrees C
+ * @return the sensor status, tempC is only set when ok
+ */
+SensorStatus tempModelConvert(const TempModel *m, float v, float *tempC)
+{
+	float x;
+	int i;
+
+	/* an open probe pulls the input up to the front end voltage */
+	if (v > m->vHi)
+		return SENSOR_STATUS_NOT_CONNECTED;
+
+	if (v < m->vLo)
+		return SENSOR_STATUS_SHORT;
+
+	x = (v - m->vLo) * m->cellsPerVolt;
+	i = x;
+	if (i >= TEMP_MODEL_LUT_SIZE)
+		i = TEMP_MODEL_LUT_SIZE - 1;
+
+	*tempC = m->lut[i][0] + (x - i) * m->lut[i][1];
+
+	return SENSOR_STATUS_OK;
+}
@@ -0,0 +1,6 @@
+SRCS += test.c
+# the code under test
+SRCS += ../src/adc.c
+SRCS += ../src/tankshape.c
+SRCS += ../src/strapping.c
+SRCS += ../src/tempmodel.c
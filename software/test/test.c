@@ -0,0 +1,432 @@
+/*
+ * Checks of the sample filters, exits non-zero when one fails. It needs
+ * neither the hardware nor D-Bus. The fixed point filter is checked in
+ * builds with FIXED_POINT set.
+ *
+ *     dbus-adc-test
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <velib/platform/plt.h>
+
+#include "sensors.h"
+
+#define TEST_LANES		515 /* not a multiple of any vector width */
+#define TEST_TICKS		200
+
+static int failures;
+
+static void fail(const char *test, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	printf("FAIL %s: ", test);
+	vprintf(fmt, ap);
+	printf("\n");
+	va_end(ap);
+
+	failures++;
+}
+
+/* steps, noise and spikes around a few levels, in adc counts */
+static float testSample(int lane, int tick)
+{
+	float level = (lane * 7 + (tick / 50) * 1000) % 4096;
+	float noise = rand() % 21 - 10;
+
+	if (rand() % 50 == 0)
+		noise *= 100;
+
+	return fminf(fmaxf(level + noise, 0), 4095);
+}
+
+static struct {
+	float scale[TEST_LANES];
+	float FF[TEST_LANES];
+	float alpha[TEST_LANES];
+} lanes;
+
+static void initLanes(void)
+{
+	int i;
+
+	for (i = 0; i < TEST_LANES; i++) {
+		lanes.scale[i] = (i % 3 ? 1.8f : 5.0f) / 4095;
+		lanes.FF[i] = i % 5 ? 0.2f + 0.1f * (i % 3) : 0;
+		lanes.alpha[i] = adcFilterAlpha(0.001f * (1 + i % 100), 0.1f);
+	}
+}
+
+/* the vectorized filter has to match the scalar reference bit for bit */
+static void testFilterBatch(void)
+{
+	static float last[2][TEST_LANES], raw[2][TEST_LANES], out[2][TEST_LANES];
+	static sn32 resets[2][TEST_LANES];
+	float value[TEST_LANES];
+	sn32 update[TEST_LANES];
+	int i, k, t;
+
+	for (k = 0; k < 2; k++)
+		for (i = 0; i < TEST_LANES; i++)
+			last[k][i] = HUGE_VALF;
+
+	for (t = 0; t < TEST_TICKS; t++) {
+		int n = TEST_LANES - t % 8;
+
+		for (i = 0; i < TEST_LANES; i++) {
+			value[i] = testSample(i, t);
+			update[i] = rand() % 4 != 0;
+		}
+
+		for (k = 0; k < 2; k++) {
+			AdcFilterBatch b = {
+				value, update, lanes.scale, lanes.FF, lanes.alpha,
+				last[k], raw[k], out[k], resets[k]
+			};
+
+			if (k)
+				adcFilterBatch(&b, n);
+			else
+				adcFilterBatchRef(&b, n);
+		}
+
+		if (memcmp(out[0], out[1], sizeof(out[0])) || memcmp(raw[0], raw[1], sizeof(raw[0])) ||
+				memcmp(last[0], last[1], sizeof(last[0])) ||
+				memcmp(resets[0], resets[1], sizeof(resets[0]))) {
+			fail("filter batch", "differs from the reference at tick %d", t);
+			return;
+		}
+	}
+}
+
+#ifdef ADC_FIXED_POINT
+#define FIXED_TOLERANCE		50e-6f /* V */
+
+/* the fixed point filter has to follow the float reference closely */
+static void testFilterBatchFixed(void)
+{
+	static float value[TEST_LANES], FF[TEST_LANES], last[TEST_LANES], raw[TEST_LANES], out[TEST_LANES];
+	static sn32 resets[TEST_LANES], resetsQ[TEST_LANES];
+	static un32 valueQ[TEST_LANES], scaleQ[TEST_LANES];
+	static sn32 FFQ[TEST_LANES], alphaQ[TEST_LANES], lastQ[TEST_LANES];
+	static sn32 rawQ[TEST_LANES], outQ[TEST_LANES];
+	sn32 update[TEST_LANES];
+	AdcFilterBatch b = {
+		value, update, lanes.scale, FF, lanes.alpha,
+		last, raw, out, resets
+	};
+	AdcFilterBatchFixed q = {
+		valueQ, update, scaleQ, FFQ, alphaQ,
+		lastQ, rawQ, outQ, resetsQ
+	};
+	float worst = 0;
+	int i, t;
+
+	/* the sensors always fast follow, the float filter starts with it */
+	for (i = 0; i < TEST_LANES; i++) {
+		FF[i] = lanes.FF[i] ? lanes.FF[i] : 0.3f;
+		scaleQ[i] = lanes.scale[i] * 4294967296.0;
+		FFQ[i] = lrintf(FF[i] * Q24_ONE);
+		alphaQ[i] = lrintf(lanes.alpha[i] * Q30_ONE);
+		last[i] = HUGE_VALF;
+		lastQ[i] = Q_UNSET;
+	}
+
+	for (t = 0; t < TEST_TICKS; t++) {
+		for (i = 0; i < TEST_LANES; i++) {
+			value[i] = (un32) testSample(i, t);
+			valueQ[i] = (un32) value[i] << 16;
+			update[i] = rand() % 4 != 0;
+		}
+
+		adcFilterBatchRef(&b, TEST_LANES);
+		adcFilterBatchFixed(&q, TEST_LANES);
+
+		for (i = 0; i < TEST_LANES; i++) {
+			float e = fmaxf(fabsf((float) outQ[i] / Q24_ONE - out[i]),
+							fabsf((float) rawQ[i] / Q24_ONE - raw[i]));
+
+			if (e > worst)
+				worst = e;
+
+			if (!(e <= FIXED_TOLERANCE) || resets[i] != resetsQ[i]) {
+				fail("fixed point filter", "lane %d tick %d: %g V off, %d vs %d resets",
+					 i, t, e, resetsQ[i], resets[i]);
+				return;
+			}
+		}
+	}
+
+	printf("fixed point filter: %.2f uV at worst\n", worst * 1e6);
+}
+#endif
+
+/* the search of the shape points the lookup table replaced */
+static float shapeLevelRef(float const (*points)[2], int n, float level)
+{
+	int i;
+
+	for (i = 1; i < n; i++) {
+		if (points[i][0] >= level) {
+			float s0 = points[i - 1][0];
+			float s1 = points[i    ][0];
+			float l0 = points[i - 1][1];
+			float l1 = points[i    ][1];
+			return l0 + (level - s0) / (s1 - s0) * (l1 - l0);
+		}
+	}
+
+	return level;
+}
+
+#define SHAPE_STEPS			100000
+#define SHAPE_TOLERANCE		1e-5f /* float rounding, times slopes up to 99 */
+
+/* the shape lookup table has to follow the points it was built from */
+static void testTankShape(void)
+{
+	static const char *shapes[] = {
+		"50:50",
+		"1:99",
+		"99:1",
+		"25:10,50:40,75:60",
+		"10:2,20:5,30:11,40:20,50:32,60:46,70:61,80:75,90:88",
+	};
+	static const char *invalid[] = { "50:50,40:60", "50:50,60:50", "0:10", "50:100", "50" };
+	float points[TANK_SHAPE_MAX_POINTS + 1][2];
+	struct TankSensor tank;
+	char every[TANK_SHAPE_MAX_POINTS * 8];
+	float worst = 0;
+	unsigned k;
+	int i, n;
+
+	/* a point at every other percent */
+	every[0] = 0;
+	for (i = 2; i < 100; i += 2)
+		sprintf(every + strlen(every), "%s%d:%d", i > 2 ? "," : "", i, i / 2 + 25);
+
+	for (k = 0; k <= sizeof(shapes) / sizeof(shapes[0]); k++) {
+		const char *spec = k < sizeof(shapes) / sizeof(shapes[0]) ? shapes[k] : every;
+
+		n = tankShapeParse(spec, points);
+		if (!n) {
+			fail("tank shape", "'%s' rejected", spec);
+			continue;
+		}
+		tankShapeCompile(&tank, points, n);
+
+		for (i = 0; i <= SHAPE_STEPS; i++) {
+			float level = (float) i / SHAPE_STEPS;
+			float e = fabsf(tankShapeLevel(&tank, level) - shapeLevelRef(points, n, level));
+
+			if (e > worst)
+				worst = e;
+
+			if (!(e <= SHAPE_TOLERANCE)) {
+				fail("tank shape", "'%s' at %g: %g off", spec, level, e);
+				break;
+			}
+		}
+	}
+
+	for (k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++)
+		if (tankShapeParse(invalid[k], points))
+			fail("tank shape", "'%s' accepted", invalid[k]);
+
+	printf("tank shape: %.2g at worst\n", worst);
+}
+
+/* writes a strapping table to a temporary file, returns its name */
+static const char *strappingFile(const char *rows)
+{
+	static char name[32];
+	int fd;
+
+	strcpy(name, "/tmp/dbus-adc-test.XXXXXX");
+	fd = mkstemp(name);
+	if (fd < 0 || write(fd, rows, strlen(rows)) != (ssize_t) strlen(rows)) {
+		perror(name);
+		pltExit(1);
+	}
+	close(fd);
+
+	return name;
+}
+
+static veBool strappingLoadRows(const char *rows, float *node, int n)
+{
+	const char *file = strappingFile(rows);
+	veBool ok = strappingLoad(file, node, n);
+
+	unlink(file);
+
+	return ok;
+}
+
+#define STRAPPING_NODES		201 /* a node at every row of the table below */
+
+/* the monotone spline has to pass through the rows, never running backwards */
+static void testStrapping(void)
+{
+	static const double volume[] = { 0, 1, 2, 60, 61, 61, 62, 90, 99, 99.5, 100 };
+	static const char *invalid[] = {
+		"0,0\n10,5\n20,4\n", /* volume decreasing */
+		"0,0\n10,5\n10,6\n", /* height not increasing */
+		"0,0\n10,5\nx,6\n", /* a malformed row after the first */
+		"0,0\n", /* a single row */
+		"0,5\n10,5\n", /* no change in volume */
+	};
+	float node[STRAPPING_NODES];
+	char rows[512] = "height;volume\n";
+	char longRow[256];
+	unsigned k;
+	int i;
+
+	for (k = 0; k < sizeof(volume) / sizeof(volume[0]); k++)
+		sprintf(rows + strlen(rows), "%u,%g\n", 10 * k, volume[k]);
+
+	if (!strappingLoadRows(rows, node, STRAPPING_NODES)) {
+		fail("strapping", "valid table rejected");
+		return;
+	}
+
+	if (node[0] != 0 || fabsf(node[STRAPPING_NODES - 1] - 1) > 1e-6f)
+		fail("strapping", "ends at %g and %g, not 0 and 1", node[0], node[STRAPPING_NODES - 1]);
+
+	for (k = 0; k < sizeof(volume) / sizeof(volume[0]); k++) {
+		float want = volume[k] / 100;
+		float got = node[k * (STRAPPING_NODES - 1) / 10];
+
+		if (fabsf(got - want) > 1e-6f)
+			fail("strapping", "row %u: %g instead of %g", k, got, want);
+	}
+
+	for (i = 1; i < STRAPPING_NODES; i++) {
+		if (node[i] < node[i - 1]) {
+			fail("strapping", "decreasing at node %d, %g after %g", i, node[i], node[i - 1]);
+			break;
+		}
+	}
+
+	for (k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++)
+		if (strappingLoadRows(invalid[k], node, STRAPPING_NODES))
+			fail("strapping", "invalid table %u accepted", k);
+
+	/* a row longer than the line buffer must not be split in two */
+	memset(longRow, ' ', sizeof(longRow));
+	strcpy(longRow + sizeof(longRow) - 8, "10,5\n");
+	snprintf(rows, sizeof(rows), "0,0\n%s20,9\n", longRow);
+	if (strappingLoadRows(rows, node, STRAPPING_NODES))
+		fail("strapping", "long line accepted");
+}
+
+/* the voltage across a probe in the front end, as the adc sees it */
+static float probeVolts(const TempModel *m, double tempC)
+{
+	double r = m->resistance(tempC);
+
+	r = r * m->fe.load / (r + m->fe.load);
+
+	return m->fe.supply * r / (r + m->fe.pullUp);
+}
+
+/* temperatures have to survive the trip through the probe and the table */
+static void testTempModels(void)
+{
+	static const struct {
+		const char *name;
+		TempFrontEnd fe;
+		float tolerance; /* C */
+	} probes[] = {
+		{ "ntc", { 5.0f, 2200, 14700 }, 0.2f },
+		{ "ntc", { 3.3f, 10000, 14700 }, 0.2f },
+		{ "pt100", { 5.0f, 2200, 14700 }, 0.01f },
+		{ "pt1000", { 5.0f, 2200, 14700 }, 0.01f },
+	};
+	unsigned k;
+
+	if (tempModelGet("pt42", &probes[0].fe))
+		fail("temp model", "unknown model found");
+
+	for (k = 0; k < sizeof(probes) / sizeof(probes[0]); k++) {
+		const TempModel *m = tempModelGet(probes[k].name, &probes[k].fe);
+		float worst = 0;
+		float t, tempC;
+
+		if (!m) {
+			fail("temp model", "%s not found", probes[k].name);
+			continue;
+		}
+
+		if (tempModelGet(probes[k].name, &probes[k].fe) != m)
+			fail("temp model", "%s built twice for the same front end", probes[k].name);
+
+		for (t = m->minC + 0.5f; t < m->maxC; t += 0.5f) {
+			float e;
+
+			if (tempModelConvert(m, probeVolts(m, t), &tempC) != SENSOR_STATUS_OK) {
+				fail("temp model", "%s at %g C not ok", m->name, t);
+				break;
+			}
+
+			e = fabsf(tempC - t);
+			if (e > worst)
+				worst = e;
+			if (!(e <= probes[k].tolerance)) {
+				fail("temp model", "%s at %g C reads %g C", m->name, t, tempC);
+				break;
+			}
+		}
+
+		/* an open probe is pulled up to the supply, a shorted one down to 0 */
+		if (tempModelConvert(m, m->fe.supply, &tempC) != SENSOR_STATUS_NOT_CONNECTED ||
+				tempModelConvert(m, m->vHi + 0.001f, &tempC) != SENSOR_STATUS_NOT_CONNECTED)
+			fail("temp model", "%s: open probe not reported", m->name);
+		if (tempModelConvert(m, 0, &tempC) != SENSOR_STATUS_SHORT ||
+				tempModelConvert(m, m->vLo - 0.001f, &tempC) != SENSOR_STATUS_SHORT)
+			fail("temp model", "%s: shorted probe not reported", m->name);
+		if (tempModelConvert(m, m->vHi, &tempC) != SENSOR_STATUS_OK ||
+				tempModelConvert(m, m->vLo, &tempC) != SENSOR_STATUS_OK)
+			fail("temp model", "%s: ends of the range not ok", m->name);
+
+		printf("temp model %s %.1f V %.0f ohm: %.4f C at worst\n",
+			   m->name, m->fe.supply, m->fe.pullUp, worst);
+	}
+}
+
+void taskInit(void)
+{
+	srand(1);
+	initLanes();
+
+	testFilterBatch();
+	testTankShape();
+	testStrapping();
+	testTempModels();
+#ifdef ADC_FIXED_POINT
+	testFilterBatchFixed();
+#endif
+
+	printf("%s\n", failures ? "FAILED" : "ok");
+	pltExit(failures ? 1 : 0);
+}
+
+void taskUpdate(void)
+{
+}
+
+void taskTick(void)
+{
+}
+
+char const *pltProgramVersion(void)
+{
+	return "test";
+}